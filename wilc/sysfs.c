@@ -24,6 +24,14 @@ static ssize_t wilc_sysfs_show(struct kobject *kobj,
 		attr_val = wl->attr_sysfs.antenna1;
 	else if (strcmp(attr->attr.name, "antenna2") == 0)
 		attr_val = wl->attr_sysfs.antenna2;
+	else if (strcmp(attr->attr.name, "tx_quantum_vo") == 0)
+		attr_val = wl->tx_sched.quantum[AC_VO_Q];
+	else if (strcmp(attr->attr.name, "tx_quantum_vi") == 0)
+		attr_val = wl->tx_sched.quantum[AC_VI_Q];
+	else if (strcmp(attr->attr.name, "tx_quantum_be") == 0)
+		attr_val = wl->tx_sched.quantum[AC_BE_Q];
+	else if (strcmp(attr->attr.name, "tx_quantum_bk") == 0)
+		attr_val = wl->tx_sched.quantum[AC_BK_Q];
 
 	return sprintf(buf, "%d\n", attr_val);
 }
@@ -47,6 +55,21 @@ static ssize_t wilc_sysfs_store(struct kobject *kobj,
 		wl->attr_sysfs.antenna1 = attr_val;
 	} else if (strcmp(attr->attr.name, "antenna2") == 0) {
 		wl->attr_sysfs.antenna2 = attr_val;
+	} else if (strncmp(attr->attr.name, "tx_quantum_", 11) == 0) {
+		u8 ac;
+
+		if (strcmp(attr->attr.name, "tx_quantum_vo") == 0)
+			ac = AC_VO_Q;
+		else if (strcmp(attr->attr.name, "tx_quantum_vi") == 0)
+			ac = AC_VI_Q;
+		else if (strcmp(attr->attr.name, "tx_quantum_be") == 0)
+			ac = AC_BE_Q;
+		else
+			ac = AC_BK_Q;
+
+		if (wilc_wlan_set_tx_quantum(wl, ac, attr_val))
+			pr_err("Valid TX quantum is %d to %d bytes\n",
+			       WILC_TX_QUANTUM_MIN, WILC_TX_BUFF_SIZE);
 	}
 
 	return count;
@@ -64,12 +87,27 @@ static struct kobj_attribute ant_swtch_antenna1_attr =
 static struct kobj_attribute ant_swtch_antenna2_attr =
 	__ATTR(antenna2, 0664, wilc_sysfs_show, wilc_sysfs_store);
 
+static struct kobj_attribute tx_quantum_vo_attr =
+	__ATTR(tx_quantum_vo, 0664, wilc_sysfs_show, wilc_sysfs_store);
+
+static struct kobj_attribute tx_quantum_vi_attr =
+	__ATTR(tx_quantum_vi, 0664, wilc_sysfs_show, wilc_sysfs_store);
+
+static struct kobj_attribute tx_quantum_be_attr =
+	__ATTR(tx_quantum_be, 0664, wilc_sysfs_show, wilc_sysfs_store);
+
+static struct kobj_attribute tx_quantum_bk_attr =
+	__ATTR(tx_quantum_bk, 0664, wilc_sysfs_show, wilc_sysfs_store);
 
 static struct attribute *wilc_attrs[] = {
 	&p2p_mode_attr.attr,
 	&ant_swtch_mode_attr.attr,
 	&ant_swtch_antenna1_attr.attr,
 	&ant_swtch_antenna2_attr.attr,
+	&tx_quantum_vo_attr.attr,
+	&tx_quantum_vi_attr.attr,
+	&tx_quantum_be_attr.attr,
+	&tx_quantum_bk_attr.attr,
 	NULL
 };
 
@@ -602,6 +602,7 @@ static void wilc_bt_start(struct wilc *wilc)
 	acquire_bus(wilc, WILC_BUS_ACQUIRE_AND_WAKEUP, DEV_BT);
 
 	pr_info("Starting BT firmware\n");
+	wilc_reg_cache_invalidate(wilc);
 	/*
 	 * Write the firmware download complete magic value 0x10ADD09E at
 	 * location 0xFFFF000C (Cortus map) or C000C (AHB map).
@@ -6,15 +6,19 @@
 
 #include <linux/module.h>
 #include <linux/debugfs.h>
+#include <linux/log2.h>
 
-#include "wilc_debugfs.h"
+#include "wilc_wfi_netdevice.h"
 
 atomic_t WILC_DEBUG_REGION = ATOMIC_INIT(INIT_DBG | GENERIC_DBG |
 					 CFG80211_DBG | HOSTAPD_DBG |
 					 PWRDEV_DBG);
 
 #if defined(WILC_DEBUGFS)
+/* shared by all devices, each one adds a directory of its own below */
 static struct dentry *wilc_dir;
+static unsigned int wilc_dir_users;
+static DEFINE_MUTEX(wilc_dir_lock);
 
 static ssize_t wilc_debug_region_read(struct file *file, char __user *userbuf,
 				     size_t count, loff_t *ppos)
@@ -57,6 +61,296 @@ static ssize_t wilc_debug_region_write(struct file *filp,
 	return count;
 }
 
+static ssize_t wilc_tx_stats_read(struct file *file, char __user *userbuf,
+				  size_t count, loff_t *ppos)
+{
+	struct wilc *wl = file->private_data;
+	struct wilc_tx_stats *st = &wl->tx_stats;
+	struct wilc_vif *vif;
+	u32 ack_replaced = 0, ack_dropped = 0;
+	char buf[256];
+	int res = 0;
+	int srcu_idx;
+
+	/* only allow read from start */
+	if (*ppos > 0)
+		return 0;
+
+	srcu_idx = srcu_read_lock(&wl->srcu);
+	list_for_each_entry_rcu(vif, &wl->vif_list, list) {
+		ack_replaced += vif->ack_filter.replaced;
+		ack_dropped += vif->ack_filter.dropped;
+	}
+	srcu_read_unlock(&wl->srcu, srcu_idx);
+
+	res = scnprintf(buf, sizeof(buf),
+			"batches: %u\nframes: %u\nbus busy: %llu us\nbus idle: %llu us\nacks replaced: %u\nacks dropped: %u\n",
+			st->batches, st->frames,
+			div_u64(st->bus_busy_ns, NSEC_PER_USEC),
+			div_u64(st->bus_idle_ns, NSEC_PER_USEC),
+			ack_replaced, ack_dropped);
+
+	return simple_read_from_buffer(userbuf, count, ppos, buf, res);
+}
+
+static ssize_t wilc_tx_stats_write(struct file *file, const char __user *buf,
+				   size_t count, loff_t *ppos)
+{
+	struct wilc *wl = file->private_data;
+	struct wilc_vif *vif;
+	unsigned long flags;
+	int srcu_idx;
+
+	/* any write clears the counters, under the locks of their writers */
+	mutex_lock(&wl->txq_add_to_head_cs);
+	wl->tx_stats.batches = 0;
+	wl->tx_stats.frames = 0;
+	mutex_lock(&wl->hif_cs);
+	wl->tx_stats.bus_busy_ns = 0;
+	wl->tx_stats.bus_idle_ns = 0;
+	mutex_unlock(&wl->hif_cs);
+	mutex_unlock(&wl->txq_add_to_head_cs);
+
+	srcu_idx = srcu_read_lock(&wl->srcu);
+	list_for_each_entry_rcu(vif, &wl->vif_list, list) {
+		spin_lock_irqsave(&vif->ack_filter.lock, flags);
+		vif->ack_filter.replaced = 0;
+		vif->ack_filter.dropped = 0;
+		spin_unlock_irqrestore(&vif->ack_filter.lock, flags);
+	}
+	srcu_read_unlock(&wl->srcu, srcu_idx);
+
+	return count;
+}
+
+static ssize_t wilc_tx_codel_read(struct file *file, char __user *userbuf,
+				  size_t count, loff_t *ppos)
+{
+	static const char * const ac_name[NQUEUES] = {
+		[AC_VO_Q] = "VO", [AC_VI_Q] = "VI",
+		[AC_BE_Q] = "BE", [AC_BK_Q] = "BK",
+	};
+	struct wilc *wl = file->private_data;
+	struct wilc_codel *c;
+	char buf[512];
+	int res = 0;
+	u8 ac;
+
+	/* only allow read from start */
+	if (*ppos > 0)
+		return 0;
+
+	for (ac = 0; ac < NQUEUES; ac++) {
+		c = &wl->txq[ac].codel;
+		res += scnprintf(buf + res, sizeof(buf) - res,
+				 "%s: packets %u drops %u marks %u sojourn avg %llu us max %llu us\n",
+				 ac_name[ac], c->packets, c->drops, c->marks,
+				 c->packets ?
+				 div_u64(div_u64(c->sojourn_sum_ns, c->packets),
+					 NSEC_PER_USEC) : 0,
+				 div_u64(c->sojourn_max_ns, NSEC_PER_USEC));
+	}
+
+	return simple_read_from_buffer(userbuf, count, ppos, buf, res);
+}
+
+static ssize_t wilc_tx_codel_write(struct file *file, const char __user *buf,
+				   size_t count, loff_t *ppos)
+{
+	struct wilc *wl = file->private_data;
+	struct wilc_codel *c;
+	u8 ac;
+
+	/* any write clears the statistics, the CoDel state is kept */
+	mutex_lock(&wl->txq_add_to_head_cs);
+	for (ac = 0; ac < NQUEUES; ac++) {
+		c = &wl->txq[ac].codel;
+		c->packets = 0;
+		c->drops = 0;
+		c->marks = 0;
+		c->sojourn_sum_ns = 0;
+		c->sojourn_max_ns = 0;
+	}
+	mutex_unlock(&wl->txq_add_to_head_cs);
+
+	return count;
+}
+
+/* copy of the RX counters, with the time spent so far in the current mode */
+static void wilc_rx_stats_get(struct wilc *wl, struct wilc_rx_stats *st)
+{
+	u64 cur;
+
+	*st = wl->rx_stats;
+	cur = ktime_to_ns(ktime_sub(ktime_get(), wl->irq_mod.mode_since));
+	if (wl->irq_mod.polling)
+		st->poll_mode_ns += cur;
+	else
+		st->irq_mode_ns += cur;
+}
+
+static ssize_t wilc_rx_stats_read(struct file *file, char __user *userbuf,
+				  size_t count, loff_t *ppos)
+{
+	struct wilc *wl = file->private_data;
+	struct wilc_rx_stats *base = &wl->rx_stats_base;
+	struct wilc_rx_stats st;
+	char buf[256];
+	int res = 0;
+
+	/* only allow read from start */
+	if (*ppos > 0)
+		return 0;
+
+	wilc_rx_stats_get(wl, &st);
+	res = scnprintf(buf, sizeof(buf),
+			"demux misses: %u\nirqs: %u\npolls: %u\nswitches to poll: %u\nswitches to irq: %u\nirq mode: %llu ms\npoll mode: %llu ms\n",
+			st.demux_miss - base->demux_miss, st.irqs - base->irqs,
+			st.polls - base->polls, st.to_poll - base->to_poll,
+			st.to_irq - base->to_irq,
+			div_u64(st.irq_mode_ns - base->irq_mode_ns,
+				NSEC_PER_MSEC),
+			div_u64(st.poll_mode_ns - base->poll_mode_ns,
+				NSEC_PER_MSEC));
+
+	return simple_read_from_buffer(userbuf, count, ppos, buf, res);
+}
+
+/*
+ * Any write clears the counters. Their writers run in the interrupt thread,
+ * the poll work and the RX path without a common lock, so the current values
+ * become the new base instead of being zeroed under them.
+ */
+static ssize_t wilc_rx_stats_write(struct file *file, const char __user *buf,
+				   size_t count, loff_t *ppos)
+{
+	struct wilc *wl = file->private_data;
+
+	wilc_rx_stats_get(wl, &wl->rx_stats_base);
+
+	return count;
+}
+
+static ssize_t wilc_bus_errors_read(struct file *file, char __user *userbuf,
+				    size_t count, loff_t *ppos)
+{
+	struct wilc *wl = file->private_data;
+	struct wilc_bus_err_stats *st = &wl->bus_err;
+	char buf[512];
+	int res = 0;
+	int i;
+
+	/* only allow read from start */
+	if (*ppos > 0)
+		return 0;
+
+	res = scnprintf(buf, sizeof(buf),
+			"transfer: %u\nno response: %u\nprotocol: %u\ncrc: %u\nretries: %u\nrecovered: %u\nfailed: %u\nslowdowns: %u\nclock: %u Hz\n",
+			st->type[WILC_BUS_ERR_XFER],
+			st->type[WILC_BUS_ERR_NO_RSP],
+			st->type[WILC_BUS_ERR_PROTO],
+			st->type[WILC_BUS_ERR_CRC], st->retries,
+			st->recovered, st->failed, st->slowdowns,
+			st->speed_hz);
+
+	for (i = 0; i < WILC_BUS_ERR_CMDS; i++)
+		if (st->cmd[i])
+			res += scnprintf(buf + res, sizeof(buf) - res,
+					 "cmd %02x: %u\n", st->cmd_base | i,
+					 st->cmd[i]);
+
+	return simple_read_from_buffer(userbuf, count, ppos, buf, res);
+}
+
+static ssize_t wilc_bus_errors_write(struct file *file,
+				     const char __user *buf, size_t count,
+				     loff_t *ppos)
+{
+	struct wilc *wl = file->private_data;
+	struct wilc_bus_err_stats *st = &wl->bus_err;
+
+	/* any write clears the counters, errors are counted under the bus */
+	mutex_lock(&wl->hif_cs);
+	memset(st->type, 0, sizeof(st->type));
+	memset(st->cmd, 0, sizeof(st->cmd));
+	st->retries = 0;
+	st->recovered = 0;
+	st->failed = 0;
+	st->slowdowns = 0;
+	mutex_unlock(&wl->hif_cs);
+
+	return count;
+}
+
+static ssize_t wilc_bus_pkt_size_read(struct file *file,
+				      char __user *userbuf, size_t count,
+				      loff_t *ppos)
+{
+	struct wilc *wl = file->private_data;
+	char buf[64];
+	int res = 0;
+
+	/* only allow read from start */
+	if (*ppos > 0)
+		return 0;
+
+	res = scnprintf(buf, sizeof(buf), "current: %u\nrequested: %u\n",
+			wl->bus_pkt_sz, wl->bus_pkt_sz_req);
+
+	return simple_read_from_buffer(userbuf, count, ppos, buf, res);
+}
+
+/* takes effect on the next bus init, 0 selects the largest size */
+static ssize_t wilc_bus_pkt_size_write(struct file *file,
+				       const char __user *buf, size_t count,
+				       loff_t *ppos)
+{
+	struct wilc *wl = file->private_data;
+	unsigned int sz;
+	int ret;
+
+	ret = kstrtouint_from_user(buf, count, 0, &sz);
+	if (ret)
+		return ret;
+
+	if (sz && !is_power_of_2(sz))
+		return -EINVAL;
+
+	wl->bus_pkt_sz_req = sz;
+
+	return count;
+}
+
+static ssize_t wilc_reg_cache_read(struct file *file, char __user *userbuf,
+				   size_t count, loff_t *ppos)
+{
+	struct wilc *wl = file->private_data;
+	struct wilc_reg_cache *c = &wl->reg_cache;
+	char buf[64];
+	int res = 0;
+
+	/* only allow read from start */
+	if (*ppos > 0)
+		return 0;
+
+	res = scnprintf(buf, sizeof(buf), "hits: %u\nmisses: %u\ncached: %u\n",
+			c->hits, c->misses, c->num);
+
+	return simple_read_from_buffer(userbuf, count, ppos, buf, res);
+}
+
+static ssize_t wilc_reg_cache_write(struct file *file, const char __user *buf,
+				    size_t count, loff_t *ppos)
+{
+	struct wilc *wl = file->private_data;
+
+	/* any write clears the counters, the cached values are kept */
+	wl->reg_cache.hits = 0;
+	wl->reg_cache.misses = 0;
+
+	return count;
+}
+
 #define FOPS(_open, _read, _write, _poll) { \
 		.owner	= THIS_MODULE, \
 		.open	= (_open), \
@@ -82,14 +376,43 @@ static struct wilc_debugfs_info_t debugfs_info[] = {
 	},
 };
 
-int wilc_debugfs_init(void)
+static const struct file_operations wilc_tx_stats_fops =
+	FOPS(simple_open, wilc_tx_stats_read, wilc_tx_stats_write, NULL);
+
+static const struct file_operations wilc_rx_stats_fops =
+	FOPS(simple_open, wilc_rx_stats_read, wilc_rx_stats_write, NULL);
+
+static const struct file_operations wilc_bus_errors_fops =
+	FOPS(simple_open, wilc_bus_errors_read, wilc_bus_errors_write, NULL);
+
+static const struct file_operations wilc_bus_pkt_size_fops =
+	FOPS(simple_open, wilc_bus_pkt_size_read, wilc_bus_pkt_size_write,
+	     NULL);
+
+static const struct file_operations wilc_reg_cache_fops =
+	FOPS(simple_open, wilc_reg_cache_read, wilc_reg_cache_write, NULL);
+
+static const struct file_operations wilc_tx_codel_fops =
+	FOPS(simple_open, wilc_tx_codel_read, wilc_tx_codel_write, NULL);
+
+/* the driver wide directory is created with the first device */
+static int wilc_debugfs_get_dir(void)
 {
 	int i;
 	struct wilc_debugfs_info_t *info;
 
+	mutex_lock(&wilc_dir_lock);
+	if (wilc_dir_users++) {
+		mutex_unlock(&wilc_dir_lock);
+		return 0;
+	}
+
 	wilc_dir = debugfs_create_dir("wilc", NULL);
-	if (wilc_dir == NULL) {
+	if (IS_ERR_OR_NULL(wilc_dir)) {
 		pr_err("Error creating debugfs\n");
+		wilc_dir = NULL;
+		wilc_dir_users--;
+		mutex_unlock(&wilc_dir_lock);
 		return -EFAULT;
 	}
 	for (i = 0; i < ARRAY_SIZE(debugfs_info); i++) {
@@ -100,12 +423,61 @@ int wilc_debugfs_init(void)
 				    &info->data,
 				    &info->fops);
 	}
+	mutex_unlock(&wilc_dir_lock);
+
+	return 0;
+}
+
+static void wilc_debugfs_put_dir(void)
+{
+	mutex_lock(&wilc_dir_lock);
+	if (!--wilc_dir_users) {
+		debugfs_remove_recursive(wilc_dir);
+		wilc_dir = NULL;
+	}
+	mutex_unlock(&wilc_dir_lock);
+}
+
+int wilc_debugfs_init(struct wilc *wl, struct device *dev)
+{
+	struct dentry *dir;
+	int ret;
+
+	ret = wilc_debugfs_get_dir();
+	if (ret)
+		return ret;
+
+	dir = debugfs_create_dir(dev_name(dev), wilc_dir);
+	if (IS_ERR_OR_NULL(dir)) {
+		pr_err("Error creating debugfs for %s\n", dev_name(dev));
+		wilc_debugfs_put_dir();
+		return -EFAULT;
+	}
+	wl->debugfs_dir = dir;
+
+	debugfs_create_file("wilc_tx_stats", 0644, dir, wl,
+			    &wilc_tx_stats_fops);
+	debugfs_create_file("wilc_tx_codel", 0644, dir, wl,
+			    &wilc_tx_codel_fops);
+	debugfs_create_file("wilc_rx_stats", 0644, dir, wl,
+			    &wilc_rx_stats_fops);
+	debugfs_create_file("wilc_bus_errors", 0644, dir, wl,
+			    &wilc_bus_errors_fops);
+	debugfs_create_file("wilc_bus_pkt_size", 0644, dir, wl,
+			    &wilc_bus_pkt_size_fops);
+	debugfs_create_file("wilc_reg_cache", 0644, dir, wl,
+			    &wilc_reg_cache_fops);
 	return 0;
 }
 
-void wilc_debugfs_remove(void)
+void wilc_debugfs_remove(struct wilc *wl)
 {
-	debugfs_remove_recursive(wilc_dir);
+	if (!wl->debugfs_dir)
+		return;
+
+	debugfs_remove_recursive(wl->debugfs_dir);
+	wl->debugfs_dir = NULL;
+	wilc_debugfs_put_dir();
 }
 
 #endif
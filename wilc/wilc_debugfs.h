@@ -45,6 +45,9 @@ extern atomic_t WILC_DEBUG_REGION;
 #define PRINT_ER(netdev, format, ...) netdev_err(netdev, "ERR [%s:%d] "format,\
 	__func__, __LINE__, ##__VA_ARGS__)
 
-int wilc_debugfs_init(void);
-void wilc_debugfs_remove(void);
+struct wilc;
+struct device;
+
+int wilc_debugfs_init(struct wilc *wl, struct device *dev);
+void wilc_debugfs_remove(struct wilc *wl);
 #endif /* WILC_DEBUGFS_H */
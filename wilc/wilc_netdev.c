@@ -151,9 +151,103 @@ static irqreturn_t isr_uh_routine(int irq, void *user_data)
 	return IRQ_WAKE_THREAD;
 }
 
+static void wilc_irq_mod_switch(struct wilc *wilc, bool polling)
+{
+	struct wilc_irq_mod *mod = &wilc->irq_mod;
+	ktime_t now = ktime_get();
+	u64 spent = ktime_to_ns(ktime_sub(now, mod->mode_since));
+
+	if (mod->polling) {
+		wilc->rx_stats.poll_mode_ns += spent;
+		wilc->rx_stats.to_irq++;
+	} else {
+		wilc->rx_stats.irq_mode_ns += spent;
+		wilc->rx_stats.to_poll++;
+	}
+	mod->mode_since = now;
+	mod->polling = polling;
+	mod->idle_polls = 0;
+	mod->window_irqs = 0;
+	mod->window_start = now;
+}
+
+static enum hrtimer_restart wilc_poll_timer(struct hrtimer *timer)
+{
+	struct wilc *wilc = container_of(timer, struct wilc, irq_mod.timer);
+
+	/* the bus sleeps, so the poll itself runs from a work item */
+	queue_work(system_highpri_wq, &wilc->irq_mod.work);
+
+	return HRTIMER_NORESTART;
+}
+
+static void wilc_poll_work(struct work_struct *work)
+{
+	struct wilc *wilc = container_of(work, struct wilc, irq_mod.work);
+	struct wilc_irq_mod *mod = &wilc->irq_mod;
+
+	if (wilc->close || mod->stop || !mod->polling)
+		return;
+
+	/* the handler that switched to polling may still be finishing */
+	synchronize_irq(wilc->dev_irq_num);
+	wilc->rx_stats.polls++;
+	if (wilc_poll_isr(wilc))
+		mod->idle_polls = 0;
+	else
+		mod->idle_polls++;
+
+	if (mod->idle_polls >= WILC_POLL_IDLE_EXIT) {
+		wilc_irq_mod_switch(wilc, false);
+		/* an edge missed while disabled is replayed by the core */
+		enable_irq(wilc->dev_irq_num);
+		return;
+	}
+
+	hrtimer_start(&mod->timer, ns_to_ktime(WILC_POLL_INTERVAL_NS),
+		      HRTIMER_MODE_REL);
+}
+
+void wilc_irq_mod_init(struct wilc *wilc)
+{
+	struct wilc_irq_mod *mod = &wilc->irq_mod;
+
+#if KERNEL_VERSION(6, 13, 0) > LINUX_VERSION_CODE
+	hrtimer_init(&mod->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	mod->timer.function = wilc_poll_timer;
+#else
+	hrtimer_setup(&mod->timer, wilc_poll_timer, CLOCK_MONOTONIC,
+		      HRTIMER_MODE_REL);
+#endif
+	INIT_WORK(&mod->work, wilc_poll_work);
+	mod->polling = false;
+	mod->stop = false;
+	mod->mode_since = ktime_get();
+	mod->window_start = mod->mode_since;
+}
+
+/* leave polling mode before the IRQ is freed */
+static void wilc_irq_mod_stop(struct wilc *wilc)
+{
+	struct wilc_irq_mod *mod = &wilc->irq_mod;
+
+	mod->stop = true;
+	/* a handler past its stop check may still switch to polling */
+	synchronize_irq(wilc->dev_irq_num);
+	hrtimer_cancel(&mod->timer);
+	cancel_work_sync(&mod->work);
+	hrtimer_cancel(&mod->timer);
+	if (mod->polling) {
+		wilc_irq_mod_switch(wilc, false);
+		enable_irq(wilc->dev_irq_num);
+	}
+}
+
 static irqreturn_t isr_bh_routine(int irq, void *userdata)
 {
 	struct wilc *wilc = (struct wilc *)userdata;
+	struct wilc_irq_mod *mod = &wilc->irq_mod;
+	ktime_t now;
 
 	if (wilc->close) {
 		pr_err("%s: Can't handle BH interrupt\n", __func__);
@@ -161,6 +255,20 @@ static irqreturn_t isr_bh_routine(int irq, void *userdata)
 	}
 
 	wilc_handle_isr(wilc);
+	wilc->rx_stats.irqs++;
+
+	now = ktime_get();
+	if (ktime_to_ns(ktime_sub(now, mod->window_start)) >
+	    WILC_IRQ_RATE_WINDOW_NS) {
+		mod->window_start = now;
+		mod->window_irqs = 0;
+	}
+	if (++mod->window_irqs > WILC_IRQ_POLL_THRESH && !mod->stop) {
+		disable_irq_nosync(irq);
+		wilc_irq_mod_switch(wilc, true);
+		hrtimer_start(&mod->timer, ns_to_ktime(WILC_POLL_INTERVAL_NS),
+			      HRTIMER_MODE_REL);
+	}
 
 	return IRQ_HANDLED;
 }
@@ -233,6 +341,7 @@ static int init_irq(struct net_device *dev)
 
 	PRINT_INFO(dev, GENERIC_DBG, "IRQ request succeeded IRQ-NUM= %d\n",
 		   wl->dev_irq_num);
+	wl->irq_mod.stop = false;
 	enable_irq_wake(wl->dev_irq_num);
 	return ret;
 
@@ -254,6 +363,7 @@ static void deinit_irq(struct net_device *dev)
 
 	/* Deinitialize IRQ */
 	if (wilc->dev_irq_num > 0) {
+		wilc_irq_mod_stop(wilc);
 		free_irq(wilc->dev_irq_num, wilc);
 		wilc->dev_irq_num = -1;
 	}
@@ -286,11 +396,51 @@ void wilc_mac_indicate(struct wilc *wilc)
 	}
 }
 
-void wilc_frmw_to_host(struct wilc_vif *vif, u8 *buff, u32 size,
-		       u32 pkt_offset, u8 status)
+/*
+ * Build the skb of a received frame. The first bytes are copied into the
+ * linear area behind NET_IP_ALIGN so the IP header is aligned. If the frame
+ * lies in an RX page the rest is attached as a page fragment, otherwise it
+ * is copied too.
+ */
+static struct sk_buff *wilc_rx_build_skb(struct wilc_vif *vif,
+					 struct page *page, u8 *data, u32 len)
+{
+	u32 hlen = len, off, flen;
+	struct sk_buff *skb;
+	struct page *head;
+
+	if (page && len > WILC_RX_COPYBREAK)
+		hlen = WILC_RX_HDR_LEN;
+
+	skb = netdev_alloc_skb_ip_align(vif->ndev, hlen);
+	if (!skb)
+		return NULL;
+
+#if KERNEL_VERSION(4, 13, 0) <= LINUX_VERSION_CODE
+	skb_put_data(skb, data, hlen);
+#else
+	memcpy(skb_put(skb, hlen), data, hlen);
+#endif
+	if (hlen < len) {
+		head = virt_to_head_page(data + hlen);
+		off = data + hlen - (u8 *)page_address(head);
+		flen = len - hlen;
+		get_page(head);
+		/*
+		 * The fragment pins the whole RX page, so charge the socket
+		 * at least every page it touches rather than its length.
+		 */
+		skb_add_rx_frag(skb, 0, head, off, flen,
+				PAGE_ALIGN(off + flen) - (off & PAGE_MASK));
+	}
+
+	return skb;
+}
+
+static void wilc_rx_deliver(struct wilc_vif *vif, struct page *page,
+			    u8 *buff, u32 size, u32 pkt_offset, u8 status)
 {
 	unsigned int frame_len = 0;
-	int stats;
 	unsigned char *buff_to_send = NULL;
 	struct sk_buff *skb;
 	struct wilc_priv *priv;
@@ -342,25 +492,107 @@ void wilc_frmw_to_host(struct wilc_vif *vif, u8 *buff, u32 size,
 			  msecs_to_jiffies(10)));
 		return;
 	}
-	skb = dev_alloc_skb(frame_len);
+	skb = wilc_rx_build_skb(vif, page, buff_to_send, frame_len);
 	if (!skb) {
 		PRINT_ER(vif->ndev, "Low memory - packet droped\n");
 		return;
 	}
 
-	skb->dev = vif->ndev;
-#if KERNEL_VERSION(4, 13, 0) <= LINUX_VERSION_CODE
-	skb_put_data(skb, buff_to_send, frame_len);
-#else
-	memcpy(skb_put(skb, frame_len), buff_to_send, frame_len);
-#endif
-
 	skb->protocol = eth_type_trans(skb, vif->ndev);
 	vif->netstats.rx_packets++;
 	vif->netstats.rx_bytes += frame_len;
 	skb->ip_summed = CHECKSUM_UNNECESSARY;
-	stats = netif_rx(skb);
-	PRINT_D(vif->ndev, RX_DBG, "netif_rx ret value: %d\n", stats);
+	skb_queue_tail(&vif->wilc->rx_napi_queue, skb);
+	/* new frames come in bursts, the RX path schedules once per burst */
+	if (status != PKT_STATUS_NEW)
+		wilc_rx_napi_schedule(vif->wilc);
+}
+
+void wilc_frmw_to_host(struct wilc_vif *vif, u8 *buff, u32 size,
+		       u32 pkt_offset, u8 status)
+{
+	wilc_rx_deliver(vif, NULL, buff, size, pkt_offset, status);
+}
+
+/* deliver a new frame that lies in @page without copying its payload */
+void wilc_frmw_to_host_page(struct wilc_vif *vif, struct page *page,
+			    u8 *buff, u32 size, u32 pkt_offset)
+{
+	wilc_rx_deliver(vif, page, buff, size, pkt_offset, PKT_STATUS_NEW);
+}
+
+void wilc_rx_napi_schedule(struct wilc *wilc)
+{
+	if (skb_queue_empty(&wilc->rx_napi_queue))
+		return;
+
+	/* called from process context, run the poll when BHs are enabled */
+	local_bh_disable();
+	napi_schedule(&wilc->napi);
+	local_bh_enable();
+}
+
+static int wilc_napi_poll(struct napi_struct *napi, int budget)
+{
+	struct wilc *wilc = container_of(napi, struct wilc, napi);
+	struct sk_buff *skb;
+	int done = 0;
+
+	while (done < budget) {
+		skb = skb_dequeue(&wilc->rx_napi_queue);
+		if (!skb)
+			break;
+		napi_gro_receive(napi, skb);
+		done++;
+	}
+
+	if (done < budget) {
+#if KERNEL_VERSION(4, 10, 0) > LINUX_VERSION_CODE
+		napi_complete(napi);
+#else
+		napi_complete_done(napi, done);
+#endif
+		/* a frame queued after the dequeue missed its schedule */
+		if (!skb_queue_empty(&wilc->rx_napi_queue))
+			napi_schedule(napi);
+	}
+
+	return done;
+}
+
+int wilc_napi_init(struct wilc *wilc)
+{
+	skb_queue_head_init(&wilc->rx_napi_queue);
+#if KERNEL_VERSION(6, 10, 0) > LINUX_VERSION_CODE
+	wilc->napi_dev = kzalloc(sizeof(*wilc->napi_dev), GFP_KERNEL);
+	if (!wilc->napi_dev)
+		return -ENOMEM;
+	init_dummy_netdev(wilc->napi_dev);
+#else
+	wilc->napi_dev = alloc_netdev_dummy(0);
+	if (!wilc->napi_dev)
+		return -ENOMEM;
+#endif
+#if KERNEL_VERSION(6, 1, 0) > LINUX_VERSION_CODE
+	netif_napi_add(wilc->napi_dev, &wilc->napi, wilc_napi_poll,
+		       NAPI_POLL_WEIGHT);
+#else
+	netif_napi_add(wilc->napi_dev, &wilc->napi, wilc_napi_poll);
+#endif
+
+	return 0;
+}
+
+void wilc_napi_deinit(struct wilc *wilc)
+{
+	netif_napi_del(&wilc->napi);
+	skb_queue_purge(&wilc->rx_napi_queue);
+#if KERNEL_VERSION(6, 10, 0) > LINUX_VERSION_CODE
+	kfree(wilc->napi_dev);
+#else
+	free_netdev(wilc->napi_dev);
+#endif
+	wilc->napi_dev = NULL;
 }
 
 void free_eap_buff_params(void *vp)
@@ -433,6 +665,41 @@ void wilc_wlan_set_bssid(struct net_device *wilc_netdev, u8 *bssid, u8 mode)
 		}
 	}
 	srcu_read_unlock(&wilc->srcu, srcu_idx);
+	wilc_rx_map_update(wilc);
+}
+
+void wilc_rx_map_update(struct wilc *wilc)
+{
+	struct wilc_rx_map *map = &wilc->rx_map;
+	struct wilc_rx_map_entry *ent;
+	struct wilc_vif *vif;
+	int srcu_idx;
+	u8 offset;
+
+	srcu_idx = srcu_read_lock(&wilc->srcu);
+	write_seqlock(&map->lock);
+	map->num = 0;
+	map->monitor = NULL;
+	list_for_each_entry_rcu(vif, &wilc->vif_list, list) {
+		/* a STA matches on the BSSID, an AP on its own address */
+		if (vif->iftype == WILC_STATION_MODE) {
+			offset = 10;
+		} else if (vif->iftype == WILC_AP_MODE) {
+			offset = 4;
+		} else {
+			if (vif->iftype == WILC_MONITOR_MODE)
+				map->monitor = vif;
+			continue;
+		}
+		if (map->num == ARRAY_SIZE(map->ent))
+			continue;
+		ent = &map->ent[map->num++];
+		ether_addr_copy(ent->bssid, vif->bssid);
+		ent->offset = offset;
+		ent->vif = vif;
+	}
+	write_sequnlock(&map->lock);
+	srcu_read_unlock(&wilc->srcu, srcu_idx);
 }
 
 #define TX_BACKOFF_WEIGHT_INCR_STEP (1)
@@ -441,6 +708,31 @@ void wilc_wlan_set_bssid(struct net_device *wilc_netdev, u8 *bssid, u8 mode)
 #define TX_BACKOFF_WEIGHT_MIN (0)
 #define TX_BCKOFF_WGHT_MS (1)
 
+/* wake the AC subqueues of every open interface that drained enough */
+static void wilc_wake_tx_queues(struct wilc *wl)
+{
+	struct wilc_vif *ifc;
+	int srcu_idx;
+	u8 ac;
+
+	/* order the dequeue before the stopped checks, see wilc_mac_xmit() */
+	smp_mb();
+	srcu_idx = srcu_read_lock(&wl->srcu);
+	list_for_each_entry_rcu(ifc, &wl->vif_list, list) {
+		if (!ifc->mac_opened)
+			continue;
+		for (ac = 0; ac < NQUEUES; ac++) {
+			if (__netif_subqueue_stopped(ifc->ndev, ac) &&
+			    wilc_wlan_txq_wake_allowed(wl, ac)) {
+				PRINT_INFO(ifc->ndev, TX_DBG,
+					   "Waking up queue %d\n", ac);
+				netif_wake_subqueue(ifc->ndev, ac);
+			}
+		}
+	}
+	srcu_read_unlock(&wl->srcu, srcu_idx);
+}
+
 static int wilc_txq_task(void *vp)
 {
 	int ret;
@@ -468,21 +760,7 @@ static int wilc_txq_task(void *vp)
 		PRINT_INFO(ndev, TX_DBG, "handle the tx packet\n");
 		do {
 			ret = wilc_wlan_handle_txq(wl, &txq_count);
-			if (txq_count < FLOW_CTRL_LOW_THRESHLD) {
-				struct wilc_vif *ifc;
-				int srcu_idx;
-
-				srcu_idx = srcu_read_lock(&wl->srcu);
-				PRINT_INFO(ndev, TX_DBG, "Waking up queue\n");
-				list_for_each_entry_rcu(ifc, &wl->vif_list,
-							list) {
-					if (ifc->mac_opened &&
-					    netif_queue_stopped(ifc->ndev))
-						netif_wake_queue(ifc->ndev);
-				}
-				srcu_read_unlock(&wl->srcu, srcu_idx);
-
-			}
+			wilc_wake_tx_queues(wl);
 
 			if (ret == -ENOBUFS) {
 				timeout = msecs_to_jiffies(TX_BCKOFF_WGHT_MS <<
@@ -801,6 +1079,7 @@ static void wlan_deinitialize_threads(struct net_device *dev)
 		kthread_stop(wl->txq_thread);
 		wl->txq_thread = NULL;
 	}
+	wilc_wlan_tx_flush(wl);
 }
 
 static void wilc_wlan_deinitialize(struct net_device *dev)
@@ -836,6 +1115,8 @@ static void wilc_wlan_deinitialize(struct net_device *dev)
 		wlan_deinitialize_threads(dev);
 		PRINT_INFO(vif->ndev, INIT_DBG, "Deinitializing IRQ\n");
 		deinit_irq(dev);
+		napi_disable(&wl->napi);
+		skb_queue_purge(&wl->rx_napi_queue);
 
 		ret = wilc_wlan_stop(wl, vif);
 		if (ret != 0)
@@ -911,9 +1192,10 @@ static int wilc_wlan_initialize(struct net_device *dev, struct wilc_vif *vif)
 			goto fail_wilc_wlan;
 		}
 
+		napi_enable(&wl->napi);
 		if (init_irq(dev)) {
 			ret = -EIO;
-			goto fail_threads;
+			goto fail_napi;
 		}
 
 		if (wl->io_type == WILC_HIF_SDIO &&
@@ -973,7 +1255,9 @@ fail_irq_enable:
 			wl->hif_func->disable_interrupt(wl);
 fail_irq_init:
 		deinit_irq(dev);
-
+fail_napi:
+		napi_disable(&wl->napi);
+		skb_queue_purge(&wl->rx_napi_queue);
 fail_threads:
 		wlan_deinitialize_threads(dev);
 fail_wilc_wlan:
@@ -987,8 +1271,8 @@ fail_wilc_wlan:
 
 static int mac_init_fn(struct net_device *ndev)
 {
-	netif_start_queue(ndev);
-	netif_stop_queue(ndev);
+	netif_tx_start_all_queues(ndev);
+	netif_tx_stop_all_queues(ndev);
 
 	return 0;
 }
@@ -1000,6 +1284,7 @@ static int wilc_mac_open(struct net_device *ndev)
 	struct wilc_priv *priv = &vif->priv;
 	unsigned char mac_add[ETH_ALEN] = {0};
 	int ret = 0;
+	int i;
 
 	if (!wl || !wl->dev) {
 		PRINT_ER(ndev, "device not ready\n");
@@ -1050,7 +1335,15 @@ static int wilc_mac_open(struct net_device *ndev)
 				 vif->ndev->ieee80211_ptr,
 				 vif->frame_reg[1].type,
 				 vif->frame_reg[1].reg);
-	netif_wake_queue(ndev);
+	/*
+	 * Frames queued before a close of this interface, while another one
+	 * kept the chip up, are still completed against the BQL state.
+	 */
+	if (!atomic_read(&vif->tx_queued)) {
+		for (i = 0; i < NQUEUES; i++)
+			netdev_tx_reset_queue(netdev_get_tx_queue(ndev, i));
+	}
+	netif_tx_wake_all_queues(ndev);
 	wl->open_ifcs++;
 	priv->p2p.local_random = 0x01;
 	vif->mac_opened = 1;
@@ -1151,28 +1444,11 @@ static void wilc_set_multicast_list(struct net_device *dev)
 		kfree(mc_list);
 }
 
-static void wilc_tx_complete(void *priv, int status)
-{
-	struct tx_complete_data *pv_data = priv;
-
-	if (status == 1)
-		PRINT_INFO(pv_data->vif->ndev, TX_DBG,
-			  "Packet sentSize= %d Add= %p SKB= %p\n",
-			  pv_data->size, pv_data->buff, pv_data->skb);
-	else
-		PRINT_INFO(pv_data->vif->ndev, TX_DBG,
-			   "Couldn't send pkt Size= %d Add= %p SKB= %p\n",
-			   pv_data->size, pv_data->buff, pv_data->skb);
-	dev_kfree_skb(pv_data->skb);
-	kfree(pv_data);
-}
-
 netdev_tx_t wilc_mac_xmit(struct sk_buff *skb, struct net_device *ndev)
 {
 	struct wilc_vif *vif = netdev_priv(ndev);
 	struct wilc *wilc = vif->wilc;
-	struct tx_complete_data *tx_data = NULL;
-	int queue_count;
+	u16 q_num;
 
 	PRINT_INFO(vif->ndev, TX_DBG,
 		   "Sending packet just received from TCP/IP\n");
@@ -1181,36 +1457,36 @@ netdev_tx_t wilc_mac_xmit(struct sk_buff *skb, struct net_device *ndev)
 		return NETDEV_TX_OK;
 	}
 
-	tx_data = kmalloc(sizeof(*tx_data), GFP_ATOMIC);
-	if (!tx_data) {
-		PRINT_ER(ndev, "Failed to alloc memory for tx_data struct\n");
-		dev_kfree_skb(skb);
-		netif_wake_queue(ndev);
-		return NETDEV_TX_OK;
-	}
-
-	tx_data->buff = skb->data;
-	tx_data->size = skb->len;
-	tx_data->skb  = skb;
-
 	PRINT_D(vif->ndev, TX_DBG, "Sending pkt Size= %d Add= %p SKB= %p\n",
-		tx_data->size, tx_data->buff, tx_data->skb);
+		skb->len, skb->data, skb);
 	PRINT_D(vif->ndev, TX_DBG, "Adding tx pkt to TX Queue\n");
 	vif->netstats.tx_packets++;
-	vif->netstats.tx_bytes += tx_data->size;
-	tx_data->vif = vif;
-	queue_count = txq_add_net_pkt(ndev, (void *)tx_data,
-				      tx_data->buff, tx_data->size,
-				      wilc_tx_complete);
+	vif->netstats.tx_bytes += skb->len;
+	q_num = skb_get_queue_mapping(skb);
+	txq_add_net_pkt(ndev, skb);
 
-	if (queue_count > FLOW_CTRL_UP_THRESHLD) {
+	/* the AC queues are shared, so stop this AC on every interface */
+	if (q_num < NQUEUES && wilc_wlan_txq_stop_needed(wilc, q_num)) {
 		struct wilc_vif *vif;
 		int srcu_idx;
 
 		srcu_idx = srcu_read_lock(&wilc->srcu);
 		list_for_each_entry_rcu(vif, &wilc->vif_list, list) {
 			if (vif->mac_opened)
-				netif_stop_queue(vif->ndev);
+				netif_stop_subqueue(vif->ndev, q_num);
+		}
+
+		/*
+		 * The TX thread may have drained the queue and checked for
+		 * stopped subqueues before they were stopped above, pairs
+		 * with the barrier in wilc_wake_tx_queues().
+		 */
+		smp_mb();
+		if (wilc_wlan_txq_wake_allowed(wilc, q_num)) {
+			list_for_each_entry_rcu(vif, &wilc->vif_list, list) {
+				if (vif->mac_opened)
+					netif_wake_subqueue(vif->ndev, q_num);
+			}
 		}
 		srcu_read_unlock(&wilc->srcu, srcu_idx);
 	}
@@ -1218,6 +1494,29 @@ netdev_tx_t wilc_mac_xmit(struct sk_buff *skb, struct net_device *ndev)
 	return NETDEV_TX_OK;
 }
 
+#if KERNEL_VERSION(3, 13, 0) > LINUX_VERSION_CODE
+static u16 wilc_select_queue(struct net_device *ndev, struct sk_buff *skb)
+#elif KERNEL_VERSION(3, 14, 0) > LINUX_VERSION_CODE
+static u16 wilc_select_queue(struct net_device *ndev, struct sk_buff *skb,
+			     void *accel_priv)
+#elif KERNEL_VERSION(4, 19, 0) > LINUX_VERSION_CODE
+static u16 wilc_select_queue(struct net_device *ndev, struct sk_buff *skb,
+			     void *accel_priv,
+			     select_queue_fallback_t fallback)
+#elif KERNEL_VERSION(5, 2, 0) > LINUX_VERSION_CODE
+static u16 wilc_select_queue(struct net_device *ndev, struct sk_buff *skb,
+			     struct net_device *sb_dev,
+			     select_queue_fallback_t fallback)
+#else
+static u16 wilc_select_queue(struct net_device *ndev, struct sk_buff *skb,
+			     struct net_device *sb_dev)
+#endif
+{
+	struct wilc_vif *vif = netdev_priv(ndev);
+
+	return wilc_wlan_select_queue(vif->wilc, skb);
+}
+
 static int wilc_mac_close(struct net_device *ndev)
 {
 	struct wilc_vif *vif = netdev_priv(ndev);
@@ -1233,7 +1532,7 @@ static int wilc_mac_close(struct net_device *ndev)
 	}
 
 	if (vif->ndev) {
-		netif_stop_queue(vif->ndev);
+		netif_tx_stop_all_queues(vif->ndev);
 
 		handle_connect_cancel(vif);
 
@@ -1281,6 +1580,7 @@ static const struct net_device_ops wilc_netdev_ops = {
 	.ndo_stop = wilc_mac_close,
 	.ndo_set_mac_address = wilc_set_mac_addr,
 	.ndo_start_xmit = wilc_mac_xmit,
+	.ndo_select_queue = wilc_select_queue,
 	.ndo_get_stats = mac_stats,
 	.ndo_set_rx_mode  = wilc_set_multicast_list,
 };
@@ -1316,6 +1616,8 @@ void wilc_netdev_cleanup(struct wilc *wilc)
 	flush_workqueue(wilc->hif_workqueue);
 	destroy_workqueue(wilc->hif_workqueue);
 	wilc->hif_workqueue = NULL;
+	destroy_workqueue(wilc->tx_workqueue);
+	wilc->tx_workqueue = NULL;
 	/* update the list */
 	do {
 		mutex_lock(&wilc->vif_mutex);
@@ -1328,12 +1630,15 @@ void wilc_netdev_cleanup(struct wilc *wilc)
 			list_del_rcu(&vif->list);
 		wilc->vif_num--;
 		mutex_unlock(&wilc->vif_mutex);
+		wilc_rx_map_update(wilc);
 		synchronize_srcu(&wilc->srcu);
 	} while (1);
 
 	cfg_deinit(wilc);
+	wilc_napi_deinit(wilc);
+	kmem_cache_destroy(wilc->txq_cache);
 #ifdef WILC_DEBUGFS
-	wilc_debugfs_remove();
+	wilc_debugfs_remove(wilc);
 #endif
 	wilc_sysfs_exit();
 	wlan_deinit_locks(wilc);
@@ -1370,7 +1675,7 @@ struct wilc_vif *wilc_netdev_ifc_init(struct wilc *wl, const char *name,
 	struct wilc_vif *vif;
 	int ret;
 
-	ndev = alloc_etherdev(sizeof(struct wilc_vif));
+	ndev = alloc_etherdev_mq(sizeof(struct wilc_vif), NQUEUES);
 	if (!ndev)
 		return ERR_PTR(-ENOMEM);
 
@@ -1381,6 +1686,7 @@ struct wilc_vif *wilc_netdev_ifc_init(struct wilc *wl, const char *name,
 	vif->wilc = wl;
 	vif->ndev = ndev;
 	ndev->ml_priv = vif;
+	wilc_ack_filter_init(&vif->ack_filter);
 	strcpy(ndev->name, name);
 	ndev->netdev_ops = &wilc_netdev_ops;
 
@@ -1415,6 +1721,7 @@ struct wilc_vif *wilc_netdev_ifc_init(struct wilc *wl, const char *name,
 	wl->vif_num += 1;
 	list_add_tail_rcu(&vif->list, &wl->vif_list);
 	mutex_unlock(&wl->vif_mutex);
+	wilc_rx_map_update(wl);
 	synchronize_srcu(&wl->srcu);
 
 	return vif;
@@ -1542,6 +1849,7 @@ int wilc_wlan_power_on_sequence(struct wilc *wilc)
 {
 	int ret;
 
+	wilc_reg_cache_invalidate(wilc);
 	ret = wilc_wlan_power(wilc, 0);
 	if (ret)
 		return ret;
@@ -1556,6 +1864,7 @@ int wilc_wlan_power_off_sequence(struct wilc *wilc)
 {
 	int ret;
 
+	wilc_reg_cache_invalidate(wilc);
 	ret = wilc_wlan_power(wilc, 0);
 	if (ret)
 		return ret;
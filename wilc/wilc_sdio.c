@@ -1104,6 +1104,30 @@ static int wilc_sdio_sync_ext(struct wilc *wilc, int nint)
 	return 1;
 }
 
+/*
+ * The host stays claimed across the whole batch so no other function's
+ * commands get in between; the nested claims of each access are cheap.
+ */
+static int wilc_sdio_reg_batch(struct wilc *wilc, struct wilc_reg_op *ops,
+			       int n)
+{
+	struct sdio_func *func = dev_to_sdio_func(wilc->dev);
+	int i, ret = 1;
+
+	sdio_claim_host(func);
+	for (i = 0; i < n && ret; i++) {
+		if (ops[i].type == WILC_REG_READ)
+			ret = wilc_sdio_read_reg(wilc, ops[i].addr,
+						 &ops[i].val);
+		else
+			ret = wilc_sdio_write_reg(wilc, ops[i].addr,
+						  ops[i].val);
+	}
+	sdio_release_host(func);
+
+	return ret;
+}
+
 /* Global sdio HIF function table */
 static const struct wilc_hif_func wilc_hif_sdio = {
 	.hif_init = wilc_sdio_init,
@@ -1118,6 +1142,7 @@ static const struct wilc_hif_func wilc_hif_sdio = {
 	.hif_block_tx_ext = wilc_sdio_write,
 	.hif_block_rx_ext = wilc_sdio_read,
 	.hif_sync_ext = wilc_sdio_sync_ext,
+	.hif_reg_batch = wilc_sdio_reg_batch,
 	.enable_interrupt = wilc_sdio_enable_interrupt,
 	.disable_interrupt = wilc_sdio_disable_interrupt,
 	.hif_reset = wilc_sdio_reset,
@@ -5,6 +5,9 @@
  */
 
 #include <linux/clk.h>
+#include <linux/crc-itu-t.h>
+#include <linux/log2.h>
+#include <linux/of.h>
 #include <linux/spi/spi.h>
 #include <linux/module.h>
 
@@ -12,12 +15,6 @@
 #include "wilc_wfi_cfgoperations.h"
 #include "wilc_netdev.h"
 
-struct wilc_spi {
-	int crc_off;
-	int nint;
-	bool is_init;
-};
-
 static const struct wilc_hif_func wilc_hif_spi;
 
 static int wilc_spi_rx(struct wilc *wilc, u8 *rb, u32 rlen);
@@ -101,15 +98,91 @@ static u8 crc7(u8 crc, const u8 *buffer, u32 len)
 
 #define SPI_RESP_RETRY_COUNT			(10)
 #define SPI_RETRY_COUNT				(10)
+/* backoff before a retry, doubling from the minimum */
+#define SPI_BACKOFF_MIN_US			50
+#define SPI_BACKOFF_MAX_US			2000
+/* more errors than this within the window halve the bus clock */
+#define SPI_ERR_WINDOW_MS			1000
+#define SPI_ERR_SLOWDOWN_THRESH			8
+#define SPI_MIN_SPEED_HZ			1000000
 #define DATA_PKT_SZ_256				256
 #define DATA_PKT_SZ_512				512
 #define DATA_PKT_SZ_1K				1024
 #define DATA_PKT_SZ_2K				(2 * 1024)
 #define DATA_PKT_SZ_4K				(4 * 1024)
 #define DATA_PKT_SZ_8K				(8 * 1024)
+/* largest data packet of the chip, the buffers are sized for it */
 #define DATA_PKT_SZ				DATA_PKT_SZ_8K
+/* smallest packet offered, a full TX buffer splits in 64 */
+#define SPI_PKT_SZ_MIN				DATA_PKT_SZ_1K
 
-#define USE_SPI_DMA				0
+/* command, response and dummy bytes of the longest command */
+#define SPI_CMD_BUF_SZ				32
+
+#define SPI_DATA_MAX_CHUNKS			(WILC_TX_BUFF_SIZE / \
+						 SPI_PKT_SZ_MIN + 1)
+
+/*
+ * order byte, split segment and crc for every chunk of a gathered block,
+ * plus the data response
+ */
+#define SPI_SG_MAX_XFERS			(WILC_TX_SG_MAX_SEGS + 3 * \
+						 SPI_DATA_MAX_CHUNKS + 1)
+
+struct wilc_spi {
+	/* commands go without CRC7 */
+	int crc_off;
+	/* data packets carry a CRC16, as currently set on the chip */
+	bool crc16;
+	/* CRC16 requested with the microchip,spi-data-crc property */
+	bool data_crc;
+	/* DMA data is split in packets of this size */
+	u32 pkt_sz;
+	int nint;
+	bool is_init;
+	/* class of the last error seen by the command in progress */
+	u8 err_type;
+	ktime_t err_window;
+	u32 window_errs;
+	/* clock from the device tree */
+	u32 max_speed_hz;
+	/*
+	 * clock of every transfer, lowered after error bursts and back to
+	 * max_speed_hz on every init
+	 */
+	u32 speed_hz;
+	struct spi_transfer *sg_xfer;
+	u8 sg_order[3];
+	u8 sg_crc[SPI_DATA_MAX_CHUNKS][2];
+	/*
+	 * Scratch for every transfer the driver builds itself, so the bus
+	 * path allocates nothing and no transfer points into the stack.
+	 * Each buffer starts on its own cacheline for the controller DMA.
+	 */
+	u8 tx_zero[DATA_PKT_SZ] ____cacheline_aligned;
+	u8 rx_sink[DATA_PKT_SZ] ____cacheline_aligned;
+	u8 cmd_wb[SPI_CMD_BUF_SZ] ____cacheline_aligned;
+	u8 cmd_rb[SPI_CMD_BUF_SZ] ____cacheline_aligned;
+	u8 rsp[SPI_CMD_BUF_SZ] ____cacheline_aligned;
+	/* one command slot per access of a register batch */
+	struct spi_transfer batch_xfer[WILC_REG_BATCH_MAX];
+	u8 batch_wb[WILC_REG_BATCH_MAX][SPI_CMD_BUF_SZ] ____cacheline_aligned;
+	u8 batch_rb[WILC_REG_BATCH_MAX][SPI_CMD_BUF_SZ] ____cacheline_aligned;
+	/* data phase of a block write queued with spi_async() */
+	struct spi_transfer *async_xfer;
+	struct spi_message async_msg;
+	/* completed while no data phase is in flight */
+	struct completion async_done;
+	void (*async_cb)(void *priv, int status);
+	void *async_priv;
+	/*
+	 * error class of the last data phase, WILC_BUS_ERR_TYPES if none;
+	 * accounted from process context once async_done is taken
+	 */
+	u8 async_err;
+	u8 async_crc[SPI_DATA_MAX_CHUNKS][2] ____cacheline_aligned;
+	u8 async_rsp[SPI_CMD_BUF_SZ] ____cacheline_aligned;
+};
 
 static int wilc_bus_probe(struct spi_device *spi)
 {
@@ -126,11 +199,29 @@ static int wilc_bus_probe(struct spi_device *spi)
 	if (!spi_priv)
 		return -ENOMEM;
 
-	ret = wilc_cfg80211_init(&wilc, dev, WILC_HIF_SPI, &wilc_hif_spi);
-	if (ret) {
-		kfree(spi_priv);
-		return ret;
+	spi_priv->sg_xfer = kcalloc(SPI_SG_MAX_XFERS,
+				    sizeof(*spi_priv->sg_xfer), GFP_KERNEL);
+	spi_priv->async_xfer = kcalloc(SPI_SG_MAX_XFERS,
+				       sizeof(*spi_priv->async_xfer),
+				       GFP_KERNEL);
+	if (!spi_priv->sg_xfer || !spi_priv->async_xfer) {
+		ret = -ENOMEM;
+		goto free_priv;
 	}
+	init_completion(&spi_priv->async_done);
+	complete(&spi_priv->async_done);
+	spi_priv->async_err = WILC_BUS_ERR_TYPES;
+	/* the chip comes out of reset with both CRCs on */
+	spi_priv->crc16 = true;
+	spi_priv->data_crc = of_property_read_bool(spi->dev.of_node,
+						   "microchip,spi-data-crc");
+	spi_priv->max_speed_hz = spi->max_speed_hz;
+	spi_priv->speed_hz = spi->max_speed_hz;
+	spi_priv->pkt_sz = DATA_PKT_SZ;
+
+	ret = wilc_cfg80211_init(&wilc, dev, WILC_HIF_SPI, &wilc_hif_spi);
+	if (ret)
+		goto free_priv;
 
 	spi_set_drvdata(spi, wilc);
 	wilc->dev = &spi->dev;
@@ -138,18 +229,16 @@ static int wilc_bus_probe(struct spi_device *spi)
 	wilc->dt_dev = &spi->dev;
 
 	wilc->rtc_clk = devm_clk_get(&spi->dev, "rtc_clk");
-	if (PTR_ERR_OR_ZERO(wilc->rtc_clk) == -EPROBE_DEFER)
-		return -EPROBE_DEFER;
-	else if (!IS_ERR(wilc->rtc_clk))
+	if (PTR_ERR_OR_ZERO(wilc->rtc_clk) == -EPROBE_DEFER) {
+		ret = -EPROBE_DEFER;
+		goto netdev_cleanup;
+	} else if (!IS_ERR(wilc->rtc_clk))
 		clk_prepare_enable(wilc->rtc_clk);
 
 	if (!init_power) {
 		ret = wilc_wlan_power_on_sequence(wilc);
-		if (ret) {
-			wilc_netdev_cleanup(wilc);
-			kfree(spi_priv);
-			return ret;
-		}
+		if (ret)
+			goto clk_disable;
 		init_power = 1;
 	}
 
@@ -157,17 +246,38 @@ static int wilc_bus_probe(struct spi_device *spi)
 
 	dev_info(dev, "WILC SPI probe success\n");
 	return 0;
+
+clk_disable:
+	if (!IS_ERR(wilc->rtc_clk))
+		clk_disable_unprepare(wilc->rtc_clk);
+netdev_cleanup:
+	kfree(spi_priv->sg_xfer);
+	kfree(spi_priv->async_xfer);
+	/* no interface was up yet, this frees spi_priv with the device */
+	wilc_netdev_cleanup(wilc);
+	return ret;
+free_priv:
+	kfree(spi_priv->sg_xfer);
+	kfree(spi_priv->async_xfer);
+	kfree(spi_priv);
+	return ret;
 }
 
 static int wilc_bus_remove(struct spi_device *spi)
 {
 	struct wilc *wilc = spi_get_drvdata(spi);
+	struct wilc_spi *spi_priv = wilc->bus_data;
+	struct spi_transfer *sg_xfer = spi_priv->sg_xfer;
+	struct spi_transfer *async_xfer = spi_priv->async_xfer;
 
 	if (!IS_ERR(wilc->rtc_clk))
 		clk_disable_unprepare(wilc->rtc_clk);
 
+	/* TX uses the transfers until the interfaces are down */
 	wilc_netdev_cleanup(wilc);
 	wilc_bt_deinit();
+	kfree(sg_xfer);
+	kfree(async_xfer);
 	return 0;
 }
 
@@ -240,39 +350,10 @@ module_spi_driver(wilc_spi_driver);
 MODULE_LICENSE("GPL");
 MODULE_VERSION("15.3");
 
-static int spi_data_rsp(struct wilc *wilc, u8 cmd)
-{
-	struct spi_device *spi = to_spi_device(wilc->dev);
-	struct wilc_spi *spi_priv = wilc->bus_data;
-	u8 len;
-	u8 rsp[3];
-	int result = N_OK;
-
-	if (!spi_priv->crc_off)
-		len = 2;
-	else
-		len = 3;
-
-	if (wilc_spi_rx(wilc, &rsp[0], len)) {
-		dev_err(&spi->dev, "Failed bus error...\n");
-		result = N_FAIL;
-		goto fail;
-	}
-
-	if ((rsp[len-1] != 0) || (rsp[len-2] != 0xC3)) {
-		dev_err(&spi->dev, "Failed data response read, %x %x %x\n",
-			rsp[0], rsp[1], rsp[2]);
-		result = N_FAIL;
-		goto fail;
-	}
-
-fail:
-	return result;
-}
-
 static int wilc_spi_tx(struct wilc *wilc, u8 *b, u32 len)
 {
 	struct spi_device *spi = to_spi_device(wilc->dev);
+	struct wilc_spi *spi_priv = wilc->bus_data;
 	int ret;
 	struct spi_message msg;
 
@@ -280,29 +361,28 @@ static int wilc_spi_tx(struct wilc *wilc, u8 *b, u32 len)
 		struct spi_transfer tr = {
 			.tx_buf = b,
 			.len = len,
+			.speed_hz = spi_priv->speed_hz,
 			.delay_usecs = 0,
 		};
-		char *r_buffer = kzalloc(len, GFP_KERNEL);
-
-		if (!r_buffer)
-			return -ENOMEM;
 
-		tr.rx_buf = r_buffer;
+		/* longer writes leave the dummy reads to the SPI core */
+		if (len <= DATA_PKT_SZ)
+			tr.rx_buf = spi_priv->rx_sink;
 		dev_dbg(&spi->dev, "Request writing %d bytes\n", len);
 
 		memset(&msg, 0, sizeof(msg));
 		spi_message_init(&msg);
 		msg.spi = spi;
-		msg.is_dma_mapped = USE_SPI_DMA;
 		spi_message_add_tail(&tr, &msg);
 
 		ret = spi_sync(spi, &msg);
-		if (ret < 0)
-			dev_err(&spi->dev, "SPI transaction failed\n");
-
-		kfree(r_buffer);
+		if (ret < 0) {
+			spi_priv->err_type = WILC_BUS_ERR_XFER;
+			dev_err_ratelimited(&spi->dev,
+				"SPI transaction failed\n");
+		}
 	} else {
-		dev_err(&spi->dev,
+		dev_err_ratelimited(&spi->dev,
 			"can't write data with the following length: %d\n",
 			len);
 		ret = -EINVAL;
@@ -314,6 +394,7 @@ static int wilc_spi_tx(struct wilc *wilc, u8 *b, u32 len)
 static int wilc_spi_rx(struct wilc *wilc, u8 *rb, u32 rlen)
 {
 	struct spi_device *spi = to_spi_device(wilc->dev);
+	struct wilc_spi *spi_priv = wilc->bus_data;
 	int ret;
 
 	if (rlen > 0) {
@@ -321,28 +402,28 @@ static int wilc_spi_rx(struct wilc *wilc, u8 *rb, u32 rlen)
 		struct spi_transfer tr = {
 			.rx_buf = rb,
 			.len = rlen,
+			.speed_hz = spi_priv->speed_hz,
 			.delay_usecs = 0,
 
 		};
-		char *t_buffer = kzalloc(rlen, GFP_KERNEL);
-
-		if (!t_buffer)
-			return -ENOMEM;
 
-		tr.tx_buf = t_buffer;
+		/* zeros are clocked out, the SPI core does it past one chunk */
+		if (rlen <= DATA_PKT_SZ)
+			tr.tx_buf = spi_priv->tx_zero;
 
 		memset(&msg, 0, sizeof(msg));
 		spi_message_init(&msg);
 		msg.spi = spi;
-		msg.is_dma_mapped = USE_SPI_DMA;
 		spi_message_add_tail(&tr, &msg);
 
 		ret = spi_sync(spi, &msg);
-		if (ret < 0)
-			dev_err(&spi->dev, "SPI transaction failed\n");
-		kfree(t_buffer);
+		if (ret < 0) {
+			spi_priv->err_type = WILC_BUS_ERR_XFER;
+			dev_err_ratelimited(&spi->dev,
+				"SPI transaction failed\n");
+		}
 	} else {
-		dev_err(&spi->dev,
+		dev_err_ratelimited(&spi->dev,
 			"can't read data with the following length: %u\n",
 			rlen);
 		ret = -EINVAL;
@@ -354,6 +435,7 @@ static int wilc_spi_rx(struct wilc *wilc, u8 *rb, u32 rlen)
 static int wilc_spi_tx_rx(struct wilc *wilc, u8 *wb, u8 *rb, u32 rlen)
 {
 	struct spi_device *spi = to_spi_device(wilc->dev);
+	struct wilc_spi *spi_priv = wilc->bus_data;
 	int ret;
 
 	if (rlen > 0) {
@@ -363,6 +445,7 @@ static int wilc_spi_tx_rx(struct wilc *wilc, u8 *wb, u8 *rb, u32 rlen)
 			.tx_buf = wb,
 			.len = rlen,
 			.bits_per_word = 8,
+			.speed_hz = spi_priv->speed_hz,
 			.delay_usecs = 0,
 
 		};
@@ -370,14 +453,16 @@ static int wilc_spi_tx_rx(struct wilc *wilc, u8 *wb, u8 *rb, u32 rlen)
 		memset(&msg, 0, sizeof(msg));
 		spi_message_init(&msg);
 		msg.spi = spi;
-		msg.is_dma_mapped = USE_SPI_DMA;
 
 		spi_message_add_tail(&tr, &msg);
 		ret = spi_sync(spi, &msg);
-		if (ret < 0)
-			dev_err(&spi->dev, "SPI transaction failed\n");
+		if (ret < 0) {
+			spi_priv->err_type = WILC_BUS_ERR_XFER;
+			dev_err_ratelimited(&spi->dev,
+				"SPI transaction failed\n");
+		}
 	} else {
-		dev_err(&spi->dev,
+		dev_err_ratelimited(&spi->dev,
 			"can't read data with the following length: %u\n",
 			rlen);
 		ret = -EINVAL;
@@ -386,19 +471,29 @@ static int wilc_spi_tx_rx(struct wilc *wilc, u8 *wb, u8 *rb, u32 rlen)
 	return ret;
 }
 
-static int spi_cmd_complete(struct wilc *wilc, u8 cmd, u32 adr, u8 *b, u32 sz,
-			    u8 clockless)
+/* CRC16 of a data packet, sent MSB first */
+static bool spi_crc16_ok(struct wilc *wilc, const u8 *buf, u32 len,
+			 const u8 *crc)
 {
 	struct spi_device *spi = to_spi_device(wilc->dev);
 	struct wilc_spi *spi_priv = wilc->bus_data;
-	u8 wb[32], rb[32];
-	u8 wix, rix;
-	u32 len2;
-	u8 rsp;
-	int len = 0;
-	int result = N_OK;
-	int retry;
-	u8 crc[2];
+	u16 calc = crc_itu_t(0xffff, buf, len);
+
+	if (calc == ((crc[0] << 8) | crc[1]))
+		return true;
+
+	spi_priv->err_type = WILC_BUS_ERR_CRC;
+	dev_err_ratelimited(&spi->dev,
+		"Data CRC mismatch, %04x != %02x%02x\n", calc,
+		crc[0], crc[1]);
+	return false;
+}
+
+/* Fill in the command bytes for @cmd, returns their count or 0 */
+static int spi_cmd_fill(struct wilc_spi *spi_priv, u8 *wb, u8 cmd, u32 adr,
+			const u8 *b, u32 sz, u8 clockless)
+{
+	int len;
 
 	wb[0] = cmd;
 	switch (cmd) {
@@ -484,24 +579,29 @@ static int spi_cmd_complete(struct wilc *wilc, u8 cmd, u32 adr, u8 *b, u32 sz,
 		break;
 
 	default:
-		result = N_FAIL;
-		break;
+		return 0;
 	}
 
-	if (result != N_OK)
-		return result;
-
 	if (!spi_priv->crc_off)
 		wb[len - 1] = (crc7(0x7f, (const u8 *)&wb[0], len - 1)) << 1;
 	else
 		len -= 1;
 
+	return len;
+}
+
 #define NUM_SKIP_BYTES (1)
 #define NUM_RSP_BYTES (2)
 #define NUM_DATA_HDR_BYTES (1)
 #define NUM_DATA_BYTES (4)
 #define NUM_CRC_BYTES (2)
 #define NUM_DUMMY_BYTES (3)
+
+/* Bytes clocked for a command of @len bytes up to the end of its response */
+static u32 spi_cmd_xfer_len(struct wilc_spi *spi_priv, u8 cmd, int len)
+{
+	u32 len2;
+
 	if (cmd == CMD_RESET ||
 	    cmd == CMD_TERMINATE ||
 	    cmd == CMD_REPEAT) {
@@ -509,29 +609,32 @@ static int spi_cmd_complete(struct wilc *wilc, u8 cmd, u32 adr, u8 *b, u32 sz,
 	} else if (cmd == CMD_INTERNAL_READ || cmd == CMD_SINGLE_READ) {
 		int tmp = NUM_RSP_BYTES + NUM_DATA_HDR_BYTES + NUM_DATA_BYTES
 			+ NUM_DUMMY_BYTES;
-		if (!spi_priv->crc_off)
+		if (spi_priv->crc16)
 			len2 = len + tmp + NUM_CRC_BYTES;
 		else
 			len2 = len + tmp;
 	} else {
 		len2 = len + (NUM_RSP_BYTES + NUM_DUMMY_BYTES);
 	}
-#undef NUM_DUMMY_BYTES
 
-	if (len2 > ARRAY_SIZE(wb)) {
-		dev_err(&spi->dev, "spi buffer size too small (%d) (%zu)\n",
-			len2, ARRAY_SIZE(wb));
-		return N_FAIL;
-	}
-	/* zero spi write buffers. */
-	for (wix = len; wix < len2; wix++)
-		wb[wix] = 0;
-	rix = len;
+	return len2;
+}
+#undef NUM_DUMMY_BYTES
 
-	if (wilc_spi_tx_rx(wilc, wb, rb, len2)) {
-		dev_err(&spi->dev, "Failed cmd write, bus error...\n");
-		return N_FAIL;
-	}
+/*
+ * Check the response to a command that was clocked into @rb, starting at
+ * *@rix. A single read stores its data word in @b. For DMA reads *@rix is
+ * left at the first data byte.
+ */
+static int spi_cmd_rsp_parse(struct wilc *wilc, u8 cmd, const u8 *rb,
+			     u32 *rixp, u32 len2, u8 *b, u8 clockless)
+{
+	struct spi_device *spi = to_spi_device(wilc->dev);
+	struct wilc_spi *spi_priv = wilc->bus_data;
+	u32 rix = *rixp;
+	int retry;
+	u8 crc[2];
+	u8 rsp;
 
 	/*
 	 * Command/Control response
@@ -546,7 +649,10 @@ static int spi_cmd_complete(struct wilc *wilc, u8 cmd, u32 adr, u8 *b, u32 sz,
 	 * even if successful.
 	 */
 	if (rsp != cmd && !clockless) {
-		dev_err(&spi->dev,
+		/* an undriven data line reads as all ones or all zeros */
+		if (rsp == 0xff || rsp == 0x00)
+			spi_priv->err_type = WILC_BUS_ERR_NO_RSP;
+		dev_err_ratelimited(&spi->dev,
 			"Failed cmd response, cmd (%02x), resp (%02x)\n",
 			cmd, rsp);
 		return N_FAIL;
@@ -557,7 +663,8 @@ static int spi_cmd_complete(struct wilc *wilc, u8 cmd, u32 adr, u8 *b, u32 sz,
 	 */
 	rsp = rb[rix++];
 	if (rsp != 0x00 && !clockless) {
-		dev_err(&spi->dev, "Failed cmd state response state (%02x)\n",
+		dev_err_ratelimited(&spi->dev,
+			"Failed cmd state response state (%02x)\n",
 			rsp);
 		return N_FAIL;
 	}
@@ -584,7 +691,8 @@ static int spi_cmd_complete(struct wilc *wilc, u8 cmd, u32 adr, u8 *b, u32 sz,
 		} while (retry--);
 
 		if (retry <= 0 && !clockless) {
-			dev_err(&spi->dev,
+			spi_priv->err_type = WILC_BUS_ERR_NO_RSP;
+			dev_err_ratelimited(&spi->dev,
 				"Error, data read response (%02x)\n", rsp);
 			return N_RESET;
 		}
@@ -600,12 +708,12 @@ static int spi_cmd_complete(struct wilc *wilc, u8 cmd, u32 adr, u8 *b, u32 sz,
 			b[2] = rb[rix++];
 			b[3] = rb[rix++];
 		} else {
-			dev_err(&spi->dev,
+			dev_err_ratelimited(&spi->dev,
 				"buffer overrun when reading data.\n");
 			return N_FAIL;
 		}
 
-		if (!spi_priv->crc_off) {
+		if (spi_priv->crc16) {
 			/*
 			 * Read Crc
 			 */
@@ -613,12 +721,61 @@ static int spi_cmd_complete(struct wilc *wilc, u8 cmd, u32 adr, u8 *b, u32 sz,
 				crc[0] = rb[rix++];
 				crc[1] = rb[rix++];
 			} else {
-				dev_err(&spi->dev,
+				dev_err_ratelimited(&spi->dev,
 					"buffer overrun when reading crc.\n");
 				return N_FAIL;
 			}
+			if (!spi_crc16_ok(wilc, b, 4, crc))
+				return N_FAIL;
 		}
-	} else if ((cmd == CMD_DMA_READ) || (cmd == CMD_DMA_EXT_READ)) {
+	}
+
+	*rixp = rix;
+	return N_OK;
+}
+
+static int spi_cmd_complete(struct wilc *wilc, u8 cmd, u32 adr, u8 *b, u32 sz,
+			    u8 clockless)
+{
+	struct spi_device *spi = to_spi_device(wilc->dev);
+	struct wilc_spi *spi_priv = wilc->bus_data;
+	u8 *wb = spi_priv->cmd_wb, *rb = spi_priv->cmd_rb;
+	u8 wix;
+	u32 rix;
+	u32 len2;
+	u8 rsp;
+	int len = 0;
+	int result = N_OK;
+	int retry;
+
+	len = spi_cmd_fill(spi_priv, wb, cmd, adr, b, sz, clockless);
+	if (!len)
+		return N_FAIL;
+
+	len2 = spi_cmd_xfer_len(spi_priv, cmd, len);
+
+	if (len2 > SPI_CMD_BUF_SZ) {
+		dev_err_ratelimited(&spi->dev,
+			"spi buffer size too small (%d) (%d)\n",
+			len2, SPI_CMD_BUF_SZ);
+		return N_FAIL;
+	}
+	/* zero spi write buffers. */
+	for (wix = len; wix < len2; wix++)
+		wb[wix] = 0;
+	rix = len;
+
+	if (wilc_spi_tx_rx(wilc, wb, rb, len2)) {
+		dev_err_ratelimited(&spi->dev,
+			"Failed cmd write, bus error...\n");
+		return N_FAIL;
+	}
+
+	result = spi_cmd_rsp_parse(wilc, cmd, rb, &rix, len2, b, clockless);
+	if (result != N_OK)
+		return result;
+
+	if ((cmd == CMD_DMA_READ) || (cmd == CMD_DMA_EXT_READ)) {
 		int ix;
 
 		/* some data may be read in response to dummy bytes. */
@@ -627,19 +784,35 @@ static int spi_cmd_complete(struct wilc *wilc, u8 cmd, u32 adr, u8 *b, u32 sz,
 
 		sz -= ix;
 
+		/* the whole block came in, its CRC may have partly too */
+		if (!sz && spi_priv->crc16) {
+			u8 *crc = spi_priv->rsp;
+			int n = 0;
+
+			while (rix < len2 && n < 2)
+				crc[n++] = rb[rix++];
+			if (n < 2 && wilc_spi_rx(wilc, &crc[n], 2 - n)) {
+				dev_err_ratelimited(&spi->dev,
+					"Failed block crc read, bus err\n");
+				return N_FAIL;
+			}
+			if (!spi_crc16_ok(wilc, b, ix, crc))
+				return N_FAIL;
+		}
+
 		if (sz > 0) {
 			int nbytes;
 
-			if (sz <= (DATA_PKT_SZ - ix))
+			if (sz <= (spi_priv->pkt_sz - ix))
 				nbytes = sz;
 			else
-				nbytes = DATA_PKT_SZ - ix;
+				nbytes = spi_priv->pkt_sz - ix;
 
 			/*
 			 * Read bytes
 			 */
 			if (wilc_spi_rx(wilc, &b[ix], nbytes)) {
-				dev_err(&spi->dev,
+				dev_err_ratelimited(&spi->dev,
 					"Failed block read, bus err\n");
 				return N_FAIL;
 			}
@@ -647,10 +820,16 @@ static int spi_cmd_complete(struct wilc *wilc, u8 cmd, u32 adr, u8 *b, u32 sz,
 			/*
 			 * Read Crc
 			 */
-			if (!spi_priv->crc_off && wilc_spi_rx(wilc, crc, 2)) {
-				dev_err(&spi->dev,
-					"Failed block crc read, bus err\n");
-				return N_FAIL;
+			if (spi_priv->crc16) {
+				if (wilc_spi_rx(wilc, spi_priv->rsp, 2)) {
+					dev_err_ratelimited(&spi->dev,
+						"Failed block crc read, bus err\n");
+					return N_FAIL;
+				}
+				/* the chunk starts with the bytes from above */
+				if (!spi_crc16_ok(wilc, b, ix + nbytes,
+						  spi_priv->rsp))
+					return N_FAIL;
 			}
 
 			ix += nbytes;
@@ -664,10 +843,10 @@ static int spi_cmd_complete(struct wilc *wilc, u8 cmd, u32 adr, u8 *b, u32 sz,
 		while (sz > 0) {
 			int nbytes;
 
-			if (sz <= DATA_PKT_SZ)
+			if (sz <= spi_priv->pkt_sz)
 				nbytes = sz;
 			else
-				nbytes = DATA_PKT_SZ;
+				nbytes = spi_priv->pkt_sz;
 
 			/*
 			 * read data response only on the next DMA cycles not
@@ -679,12 +858,13 @@ static int spi_cmd_complete(struct wilc *wilc, u8 cmd, u32 adr, u8 *b, u32 sz,
 			 */
 			retry = SPI_RESP_RETRY_COUNT;
 			do {
-				if (wilc_spi_rx(wilc, &rsp, 1)) {
-					dev_err(&spi->dev,
+				if (wilc_spi_rx(wilc, spi_priv->rsp, 1)) {
+					dev_err_ratelimited(&spi->dev,
 						"Failed resp read, bus err\n");
 					result = N_FAIL;
 					break;
 				}
+				rsp = spi_priv->rsp[0];
 				if (((rsp >> 4) & 0xf) == 0xf)
 					break;
 			} while (retry--);
@@ -696,7 +876,7 @@ static int spi_cmd_complete(struct wilc *wilc, u8 cmd, u32 adr, u8 *b, u32 sz,
 			 * Read bytes
 			 */
 			if (wilc_spi_rx(wilc, &b[ix], nbytes)) {
-				dev_err(&spi->dev,
+				dev_err_ratelimited(&spi->dev,
 					"Failed block read, bus err\n");
 				result = N_FAIL;
 				break;
@@ -705,11 +885,18 @@ static int spi_cmd_complete(struct wilc *wilc, u8 cmd, u32 adr, u8 *b, u32 sz,
 			/*
 			 * Read Crc
 			 */
-			if (!spi_priv->crc_off && wilc_spi_rx(wilc, crc, 2)) {
-				dev_err(&spi->dev,
-					"Failed block crc read, bus err\n");
-				result = N_FAIL;
-				break;
+			if (spi_priv->crc16) {
+				if (wilc_spi_rx(wilc, spi_priv->rsp, 2)) {
+					dev_err_ratelimited(&spi->dev,
+						"Failed block crc read, bus err\n");
+					result = N_FAIL;
+					break;
+				}
+				if (!spi_crc16_ok(wilc, &b[ix], nbytes,
+						  spi_priv->rsp)) {
+					result = N_FAIL;
+					break;
+				}
 			}
 
 			ix += nbytes;
@@ -719,72 +906,323 @@ static int spi_cmd_complete(struct wilc *wilc, u8 cmd, u32 adr, u8 *b, u32 sz,
 	return result;
 }
 
-static int spi_data_write(struct wilc *wilc, u8 *b, u32 sz)
+static void spi_sg_add(struct wilc_spi *spi_priv, struct spi_message *msg,
+		       struct spi_transfer *tr, const void *buf, u32 len)
+{
+	memset(tr, 0, sizeof(*tr));
+	tr->tx_buf = buf;
+	tr->len = len;
+	tr->speed_hz = spi_priv->speed_hz;
+	spi_message_add_tail(tr, msg);
+}
+
+/*
+ * Build the data phase of a block gathered from a list of segments. Every
+ * chunk is sent as order byte, data and crc, and the data response is read
+ * into @rsp at the end, all in one spi_message. With CRC16 on, the crc of a
+ * chunk is computed while its segments are walked and stored in @crc.
+ */
+static int spi_data_msg_build(struct wilc *wilc, struct spi_message *msg,
+			      struct spi_transfer *tr, u8 (*crc)[2], u8 *rsp,
+			      struct wilc_tx_seg *seg, u32 nseg, u32 sz)
 {
 	struct spi_device *spi = to_spi_device(wilc->dev);
 	struct wilc_spi *spi_priv = wilc->bus_data;
-	int ix, nbytes;
-	int result = 1;
-	u8 cmd, order, crc[2] = {0};
+	u32 ix = 0, seg_off = 0, nbytes, len;
+	int ntr = 0, nchunk = 0;
+	u16 crc_calc;
+	u8 order;
 
-	/*
-	 * Data
-	 */
-	ix = 0;
-	do {
-		if (sz <= DATA_PKT_SZ) {
+	spi_message_init(msg);
+	msg->spi = spi;
+
+	while (sz) {
+		if (sz <= spi_priv->pkt_sz) {
 			nbytes = sz;
 			order = 0x3;
 		} else {
-			nbytes = DATA_PKT_SZ;
+			nbytes = spi_priv->pkt_sz;
 			if (ix == 0)
 				order = 0x1;
 			else
 				order = 0x02;
 		}
 
-		/*
-		 * Write command
-		 */
-		cmd = 0xf0;
-		cmd |= order;
+		if (ntr + 2 >= SPI_SG_MAX_XFERS ||
+		    nchunk >= SPI_DATA_MAX_CHUNKS)
+			goto too_long;
 
-		if (wilc_spi_tx(wilc, &cmd, 1)) {
-			dev_err(&spi->dev,
-				"Failed data block cmd write, bus error...\n");
-			result = N_FAIL;
-			break;
-		}
+		spi_priv->sg_order[order - 1] = 0xf0 | order;
+		spi_sg_add(spi_priv, msg, &tr[ntr++],
+			   &spi_priv->sg_order[order - 1], 1);
 
-		/*
-		 * Write data
-		 */
-		if (wilc_spi_tx(wilc, &b[ix], nbytes)) {
-			dev_err(&spi->dev,
-				"Failed data block write, bus error...\n");
-			result = N_FAIL;
-			break;
+		ix += nbytes;
+		sz -= nbytes;
+		crc_calc = 0xffff;
+		while (nbytes) {
+			if (!nseg || ntr + 1 >= SPI_SG_MAX_XFERS)
+				goto too_long;
+
+			len = min(nbytes, seg->len - seg_off);
+			if (len)
+				spi_sg_add(spi_priv, msg, &tr[ntr++],
+					   seg->buf + seg_off, len);
+			if (len && spi_priv->crc16)
+				crc_calc = crc_itu_t(crc_calc,
+						     seg->buf + seg_off, len);
+			seg_off += len;
+			nbytes -= len;
+			if (seg_off == seg->len) {
+				seg++;
+				nseg--;
+				seg_off = 0;
+			}
 		}
 
-		/*
-		 * Write Crc
-		 */
-		if (!spi_priv->crc_off) {
-			if (wilc_spi_tx(wilc, crc, 2)) {
-				dev_err(&spi->dev, "Failed data block crc write, bus error...\n");
-				result = N_FAIL;
-				break;
-			}
+		if (spi_priv->crc16) {
+			crc[nchunk][0] = crc_calc >> 8;
+			crc[nchunk][1] = crc_calc;
+			spi_sg_add(spi_priv, msg, &tr[ntr++], crc[nchunk], 2);
 		}
+		nchunk++;
+	}
 
-		/*
-		 * No need to wait for response
-		 */
-		ix += nbytes;
-		sz -= nbytes;
-	} while (sz);
+	if (ntr >= SPI_SG_MAX_XFERS)
+		goto too_long;
 
-	return result;
+	/* data response, clocked out with zeros */
+	spi_sg_add(spi_priv, msg, &tr[ntr], spi_priv->tx_zero,
+		   spi_priv->crc_off ? 3 : 2);
+	tr[ntr].rx_buf = rsp;
+
+	return N_OK;
+
+too_long:
+	dev_err_ratelimited(&spi->dev, "sg block exceeds %d transfers\n",
+		SPI_SG_MAX_XFERS);
+	return N_FAIL;
+}
+
+static int spi_data_rsp_check(struct wilc *wilc, const u8 *rsp)
+{
+	struct spi_device *spi = to_spi_device(wilc->dev);
+	struct wilc_spi *spi_priv = wilc->bus_data;
+	u32 len = spi_priv->crc_off ? 3 : 2;
+
+	if (rsp[len - 1] != 0 || rsp[len - 2] != 0xC3) {
+		dev_err_ratelimited(&spi->dev,
+			"Failed data response read, %x %x %x\n",
+			rsp[0], rsp[1], rsp[2]);
+		return N_FAIL;
+	}
+
+	return N_OK;
+}
+
+static int spi_data_write_sg(struct wilc *wilc, struct wilc_tx_seg *seg,
+			     u32 nseg, u32 sz)
+{
+	struct spi_device *spi = to_spi_device(wilc->dev);
+	struct wilc_spi *spi_priv = wilc->bus_data;
+	struct spi_message msg;
+
+	if (spi_data_msg_build(wilc, &msg, spi_priv->sg_xfer, spi_priv->sg_crc,
+			       spi_priv->rsp, seg, nseg, sz) != N_OK)
+		return N_FAIL;
+
+	if (spi_sync(spi, &msg) < 0) {
+		spi_priv->err_type = WILC_BUS_ERR_XFER;
+		dev_err_ratelimited(&spi->dev,
+			"Failed data block sg write, bus error...\n");
+		return N_FAIL;
+	}
+
+	return spi_data_rsp_check(wilc, spi_priv->rsp);
+}
+
+static int spi_data_write(struct wilc *wilc, u8 *b, u32 sz)
+{
+	struct wilc_tx_seg seg = {
+		.buf = b,
+		.len = sz,
+	};
+
+	return spi_data_write_sg(wilc, &seg, 1, sz);
+}
+
+/*
+ * Clear the interrupt with @clear and read an RX burst of @sz bytes in one
+ * spi_message. Chip select toggles between the internal write and the DMA
+ * read command, the data is clocked in right behind the read command.
+ * Only a burst that fits in a single data packet without CRC16 is fetched
+ * this way. Returns N_RETRY if the clear went through but the read did not.
+ */
+static int spi_rx_fetch_fused(struct wilc *wilc, u32 clear, u8 *b, u32 sz)
+{
+	struct spi_device *spi = to_spi_device(wilc->dev);
+	struct wilc_spi *spi_priv = wilc->bus_data;
+	struct spi_transfer tr[3];
+	struct spi_message msg;
+	/* each command gets half of the command scratch */
+	u8 *cwb = spi_priv->cmd_wb, *crb = spi_priv->cmd_rb;
+	u8 *rwb = cwb + SPI_CMD_BUF_SZ / 2, *rrb = crb + SPI_CMD_BUF_SZ / 2;
+	__le32 dat = cpu_to_le32(clear);
+	int clen, rlen, ix, k;
+
+	memset(cwb, 0, SPI_CMD_BUF_SZ);
+	clen = spi_cmd_fill(spi_priv, cwb, CMD_INTERNAL_WRITE,
+			    0xe844 - WILC_SPI_REG_BASE, (u8 *)&dat, 4, 0);
+	rlen = spi_cmd_fill(spi_priv, rwb, CMD_DMA_EXT_READ, 0, NULL, sz, 0);
+
+	/* command, response and three dummy bytes per command */
+	memset(tr, 0, sizeof(tr));
+	tr[0].tx_buf = cwb;
+	tr[0].rx_buf = crb;
+	tr[0].len = clen + NUM_RSP_BYTES + 3;
+	tr[0].speed_hz = spi_priv->speed_hz;
+	tr[0].cs_change = 1;
+	tr[1].tx_buf = rwb;
+	tr[1].rx_buf = rrb;
+	tr[1].len = rlen + NUM_RSP_BYTES + 3;
+	tr[1].speed_hz = spi_priv->speed_hz;
+	/*
+	 * Where the data starts is only known once the dummy bytes are in, so
+	 * the rest of the packet is read into the sink and copied out. That
+	 * clocks up to two bytes past the packet, where a read with CRC16 on
+	 * gets the CRC; the fused path is only taken with CRC16 off.
+	 */
+	tr[2].tx_buf = spi_priv->tx_zero;
+	tr[2].rx_buf = spi_priv->rx_sink;
+	tr[2].len = sz;
+	tr[2].speed_hz = spi_priv->speed_hz;
+
+	spi_message_init(&msg);
+	msg.spi = spi;
+	spi_message_add_tail(&tr[0], &msg);
+	spi_message_add_tail(&tr[1], &msg);
+	spi_message_add_tail(&tr[2], &msg);
+
+	if (spi_sync(spi, &msg) < 0) {
+		dev_err_ratelimited(&spi->dev,
+			"Failed rx fetch, bus error...\n");
+		return N_FAIL;
+	}
+
+	if (crb[clen] != CMD_INTERNAL_WRITE || crb[clen + 1]) {
+		dev_err_ratelimited(&spi->dev,
+			"Failed rx fetch clear, resp (%02x %02x)\n",
+			crb[clen], crb[clen + 1]);
+		return N_FAIL;
+	}
+
+	if (rrb[rlen] != CMD_DMA_EXT_READ || rrb[rlen + 1]) {
+		dev_err_ratelimited(&spi->dev,
+			"Failed rx fetch read, resp (%02x %02x)\n",
+			rrb[rlen], rrb[rlen + 1]);
+		return N_RETRY;
+	}
+
+	/* the data response header shows up in one of the dummy bytes */
+	for (ix = rlen + NUM_RSP_BYTES; ix < tr[1].len; ix++) {
+		if (((rrb[ix] >> 4) & 0xf) == 0xf)
+			break;
+	}
+	if (ix == tr[1].len) {
+		dev_err_ratelimited(&spi->dev,
+			"Error, data read response (%02x)\n",
+			rrb[ix - 1]);
+		return N_RETRY;
+	}
+
+	/* data starts right after the header, partly in the dummy bytes */
+	k = tr[1].len - ix - 1;
+	memcpy(b, &rrb[ix + 1], k);
+	memcpy(&b[k], spi_priv->rx_sink, sz - k);
+
+	return N_OK;
+}
+
+/********************************************
+ *
+ *      Error recovery
+ *
+ ********************************************/
+
+/* Account an error and slow the bus down if they come in bursts */
+static void wilc_spi_err_count(struct wilc *wilc, u8 cmd, u8 type)
+{
+	struct spi_device *spi = to_spi_device(wilc->dev);
+	struct wilc_spi *spi_priv = wilc->bus_data;
+	struct wilc_bus_err_stats *st = &wilc->bus_err;
+	ktime_t now = ktime_get();
+
+	st->type[type]++;
+	st->cmd_base = cmd & ~(WILC_BUS_ERR_CMDS - 1);
+	st->cmd[cmd % WILC_BUS_ERR_CMDS]++;
+
+	if (ktime_after(now, ktime_add_ms(spi_priv->err_window,
+					  SPI_ERR_WINDOW_MS))) {
+		spi_priv->err_window = now;
+		spi_priv->window_errs = 0;
+	}
+
+	if (++spi_priv->window_errs < SPI_ERR_SLOWDOWN_THRESH ||
+	    spi_priv->speed_hz <= SPI_MIN_SPEED_HZ)
+		return;
+
+	spi_priv->speed_hz = max_t(u32, spi_priv->speed_hz / 2,
+				   SPI_MIN_SPEED_HZ);
+	st->speed_hz = spi_priv->speed_hz;
+	st->slowdowns++;
+	spi_priv->window_errs = 0;
+	dev_warn(&spi->dev, "Bus errors, clock lowered to %u Hz\n",
+		 spi_priv->speed_hz);
+}
+
+/*
+ * Called with the result of every attempt of a command. On failure the
+ * error is accounted, the command state machine of the chip is reset after
+ * an exponential backoff and true is returned while attempts are left.
+ */
+static bool wilc_spi_recover(struct wilc *wilc, u8 cmd, u32 addr, int result,
+			     u8 *retry)
+{
+	struct spi_device *spi = to_spi_device(wilc->dev);
+	struct wilc_spi *spi_priv = wilc->bus_data;
+	struct wilc_bus_err_stats *st = &wilc->bus_err;
+	u8 type = spi_priv->err_type;
+	unsigned long us;
+
+	/* anything not classified on the way is a protocol error */
+	spi_priv->err_type = WILC_BUS_ERR_PROTO;
+
+	if (result == N_OK) {
+		if (*retry != SPI_RETRY_COUNT)
+			st->recovered++;
+		return false;
+	}
+
+	wilc_spi_err_count(wilc, cmd, type);
+
+	if (!--*retry) {
+		st->failed++;
+		dev_err_ratelimited(&spi->dev,
+				    "cmd %02x (%08x) failed, error class %d\n",
+				    cmd, addr, type);
+		return false;
+	}
+
+	us = min_t(unsigned long,
+		   SPI_BACKOFF_MIN_US << (SPI_RETRY_COUNT - 1 - *retry),
+		   SPI_BACKOFF_MAX_US);
+	usleep_range(us, us + us / 4);
+	wilc_spi_reset(wilc);
+	spi_priv->err_type = WILC_BUS_ERR_PROTO;
+	usleep_range(SPI_BACKOFF_MIN_US, 2 * SPI_BACKOFF_MIN_US);
+	st->retries++;
+	dev_dbg(&spi->dev, "Reset and retry %d %02x %x\n", *retry, cmd, addr);
+
+	return true;
 }
 
 /********************************************
@@ -804,20 +1242,14 @@ retry:
 	result = spi_cmd_complete(wilc, CMD_INTERNAL_WRITE, adr, (u8 *)&dat, 4,
 				  0);
 	if (result != N_OK) {
-		dev_err(&spi->dev, "Failed internal write cmd...\n");
+		dev_err_ratelimited(&spi->dev,
+			"Failed internal write cmd...\n");
 		goto fail;
 	}
 
 fail:
-	if (result != N_OK) {
-		usleep_range(1000, 1100);
-		wilc_spi_reset(wilc);
-		dev_err(&spi->dev, "Reset and retry %d %x\n", retry, adr);
-		usleep_range(1000, 1100);
-		retry--;
-		if (retry)
-			goto retry;
-	}
+	if (wilc_spi_recover(wilc, CMD_INTERNAL_WRITE, adr, result, &retry))
+		goto retry;
 	return result;
 }
 
@@ -831,23 +1263,39 @@ retry:
 	result = spi_cmd_complete(wilc, CMD_INTERNAL_READ, adr, (u8 *)data, 4,
 				  0);
 	if (result != N_OK) {
-		dev_err(&spi->dev, "Failed internal read cmd...\n");
+		dev_err_ratelimited(&spi->dev, "Failed internal read cmd...\n");
 		goto fail;
 	}
 
 	le32_to_cpus(data);
 
 fail:
+	if (wilc_spi_recover(wilc, CMD_INTERNAL_READ, adr, result, &retry))
+		goto retry;
+	return result;
+}
+
+/*
+ * Read the protocol register once, with the CRC setting the driver assumes.
+ * Failing is expected if the chip kept another setting, so this does not
+ * go through the error accounting and backoff of the other commands.
+ */
+static int spi_protocol_probe(struct wilc *wilc, u32 *data)
+{
+	struct wilc_spi *spi_priv = wilc->bus_data;
+	int result;
+
+	result = spi_cmd_complete(wilc, CMD_INTERNAL_READ,
+				  WILC_SPI_PROTOCOL_OFFSET, (u8 *)data, 4, 0);
+	spi_priv->err_type = WILC_BUS_ERR_PROTO;
 	if (result != N_OK) {
-		usleep_range(1000, 1100);
 		wilc_spi_reset(wilc);
-		dev_err(&spi->dev, "Reset and retry %d %x\n", retry, adr);
-		usleep_range(1000, 1100);
-		retry--;
-		if (retry)
-			goto retry;
+		return N_FAIL;
 	}
-	return result;
+
+	le32_to_cpus(data);
+
+	return N_OK;
 }
 
 /********************************************
@@ -877,21 +1325,14 @@ _RETRY_:
 
 	result = spi_cmd_complete(wilc, cmd, addr, (u8 *)&data, 4, clockless);
 	if (result != N_OK) {
-		dev_err(&spi->dev, "Failed cmd, write reg (%08x)...\n", addr);
+		dev_err_ratelimited(&spi->dev,
+			"Failed cmd, write reg (%08x)...\n", addr);
 		goto fail;
 	}
 
 fail:
-	if (result != N_OK) {
-		usleep_range(1000, 1100);
-		wilc_spi_reset(wilc);
-		dev_err(&spi->dev,
-			"Reset and retry %d %x %d\n", retry, addr, data);
-		usleep_range(1000, 1100);
-		retry--;
-		if (retry)
-			goto _RETRY_;
-	}
+	if (wilc_spi_recover(wilc, cmd, addr, result, &retry))
+		goto _RETRY_;
 	return result;
 }
 
@@ -910,7 +1351,7 @@ static int wilc_spi_write(struct wilc *wilc, u32 addr, u8 *buf, u32 size)
 retry:
 	result = spi_cmd_complete(wilc, CMD_DMA_EXT_WRITE, addr, NULL, size, 0);
 	if (result != N_OK) {
-		dev_err(&spi->dev,
+		dev_err_ratelimited(&spi->dev,
 			"Failed cmd, write block (%08x)...\n", addr);
 		goto fail;
 	}
@@ -920,32 +1361,136 @@ retry:
 	 */
 	result = spi_data_write(wilc, buf, size);
 	if (result != N_OK) {
-		dev_err(&spi->dev, "Failed block data write...\n");
+		dev_err_ratelimited(&spi->dev, "Failed block data write...\n");
 		goto fail;
 	}
-	/*
-	 * Data RESP
-	 */
-	result = spi_data_rsp(wilc, CMD_DMA_EXT_WRITE);
+
+fail:
+	if (wilc_spi_recover(wilc, CMD_DMA_EXT_WRITE, addr, result, &retry))
+		goto retry;
+	return result;
+}
+
+static int wilc_spi_write_sg(struct wilc *wilc, u32 addr,
+			     struct wilc_tx_seg *seg, u32 nseg, u32 size)
+{
+	struct spi_device *spi = to_spi_device(wilc->dev);
+	int result;
+	u8 retry = SPI_RETRY_COUNT;
+
+	if (size <= 4)
+		return 0;
+
+retry:
+	result = spi_cmd_complete(wilc, CMD_DMA_EXT_WRITE, addr, NULL, size, 0);
 	if (result != N_OK) {
-		dev_err(&spi->dev, "Failed block data write...\n");
+		dev_err_ratelimited(&spi->dev,
+			"Failed cmd, write block (%08x)...\n", addr);
 		goto fail;
 	}
 
-fail:
+	result = spi_data_write_sg(wilc, seg, nseg, size);
 	if (result != N_OK) {
-		usleep_range(1000, 1100);
-		wilc_spi_reset(wilc);
-		dev_err(&spi->dev,
-			"Reset and retry %d %x %d\n", retry, addr, size);
-		usleep_range(1000, 1100);
-		retry--;
-		if (retry)
-			goto retry;
+		dev_err_ratelimited(&spi->dev, "Failed block data write...\n");
+		goto fail;
 	}
+
+fail:
+	if (wilc_spi_recover(wilc, CMD_DMA_EXT_WRITE, addr, result, &retry))
+		goto retry;
 	return result;
 }
 
+/* Account the error of the last data phase, called after async_done */
+static void wilc_spi_async_err_count(struct wilc *wilc)
+{
+	struct wilc_spi *spi_priv = wilc->bus_data;
+
+	if (spi_priv->async_err == WILC_BUS_ERR_TYPES)
+		return;
+	wilc_spi_err_count(wilc, CMD_DMA_EXT_WRITE, spi_priv->async_err);
+	spi_priv->async_err = WILC_BUS_ERR_TYPES;
+}
+
+/*
+ * Runs in the completion context of the controller, the error is only
+ * recorded here since the accounting may change the bus clock.
+ */
+static void wilc_spi_async_complete(void *context)
+{
+	struct wilc *wilc = context;
+	struct wilc_spi *spi_priv = wilc->bus_data;
+	int status = 0;
+
+	if (spi_priv->async_msg.status)
+		spi_priv->async_err = WILC_BUS_ERR_XFER;
+	else if (spi_data_rsp_check(wilc, spi_priv->async_rsp) != N_OK)
+		spi_priv->async_err = WILC_BUS_ERR_PROTO;
+	else
+		status = 1;
+
+	spi_priv->async_cb(spi_priv->async_priv, status);
+	complete(&spi_priv->async_done);
+}
+
+/*
+ * Like wilc_spi_write_sg(), but the data phase is queued with spi_async()
+ * and @done reports its result. Commands issued meanwhile queue up behind
+ * it on the controller, so the wire order is the same as with spi_sync().
+ * Returns 0 without calling @done if the block could not be queued.
+ */
+static int wilc_spi_write_sg_async(struct wilc *wilc, u32 addr,
+				   struct wilc_tx_seg *seg, u32 nseg, u32 size,
+				   void (*done)(void *priv, int status),
+				   void *priv)
+{
+	struct spi_device *spi = to_spi_device(wilc->dev);
+	struct wilc_spi *spi_priv = wilc->bus_data;
+	int result;
+	u8 retry = SPI_RETRY_COUNT;
+
+	if (size <= 4)
+		return 0;
+
+	/* the transfers are reused, one data phase in flight at a time */
+	wait_for_completion(&spi_priv->async_done);
+	wilc_spi_async_err_count(wilc);
+
+retry:
+	result = spi_cmd_complete(wilc, CMD_DMA_EXT_WRITE, addr, NULL, size, 0);
+	if (result != N_OK) {
+		dev_err_ratelimited(&spi->dev,
+			"Failed cmd, write block (%08x)...\n", addr);
+		goto fail;
+	}
+
+	result = spi_data_msg_build(wilc, &spi_priv->async_msg,
+				    spi_priv->async_xfer, spi_priv->async_crc,
+				    spi_priv->async_rsp, seg, nseg, size);
+	if (result != N_OK)
+		goto out;
+
+	spi_priv->async_cb = done;
+	spi_priv->async_priv = priv;
+	spi_priv->async_msg.complete = wilc_spi_async_complete;
+	spi_priv->async_msg.context = wilc;
+	if (spi_async(spi, &spi_priv->async_msg)) {
+		dev_err_ratelimited(&spi->dev,
+			"Failed data block async write...\n");
+		result = N_FAIL;
+		goto out;
+	}
+
+	return 1;
+
+fail:
+	if (wilc_spi_recover(wilc, CMD_DMA_EXT_WRITE, addr, result, &retry))
+		goto retry;
+out:
+	complete(&spi_priv->async_done);
+	return 0;
+}
+
 static int wilc_spi_read_reg(struct wilc *wilc, u32 addr, u32 *data)
 {
 	struct spi_device *spi = to_spi_device(wilc->dev);
@@ -966,23 +1511,139 @@ retry:
 
 	result = spi_cmd_complete(wilc, cmd, addr, (u8 *)data, 4, clockless);
 	if (result != N_OK) {
-		dev_err(&spi->dev, "Failed cmd, read reg (%08x)...\n", addr);
+		dev_err_ratelimited(&spi->dev,
+			"Failed cmd, read reg (%08x)...\n", addr);
 		goto fail;
 	}
 
 	le32_to_cpus(data);
 
 fail:
-	if (result != N_OK) {
-		usleep_range(1000, 1100);
+	if (wilc_spi_recover(wilc, cmd, addr, result, &retry))
+		goto retry;
+	return result;
+}
+
+/*
+ * Send every access of the batch as its own command in a single message,
+ * toggling CS between them. Every access has reached the chip once the
+ * message went out, so nothing is sent again but the reads whose response
+ * was bad, one at a time with the usual reset and retry handling. A bad
+ * write response or a failed transfer fails the batch.
+ */
+static int wilc_spi_reg_batch(struct wilc *wilc, struct wilc_reg_op *ops,
+			      int n)
+{
+	struct spi_device *spi = to_spi_device(wilc->dev);
+	struct wilc_spi *spi_priv = wilc->bus_data;
+	struct spi_transfer *tr = spi_priv->batch_xfer;
+	struct spi_message msg;
+	u8 cmd[WILC_REG_BATCH_MAX];
+	u32 len[WILC_REG_BATCH_MAX];
+	u8 clockless;
+	u32 rix;
+	__le32 dat;
+	u32 redo = 0;
+	int i;
+
+	if (n > WILC_REG_BATCH_MAX)
+		goto one_by_one;
+
+	spi_message_init(&msg);
+	msg.spi = spi;
+	memset(tr, 0, n * sizeof(*tr));
+
+	for (i = 0; i < n; i++) {
+		u8 *wb = spi_priv->batch_wb[i];
+		u32 len2;
+
+		clockless = ops[i].addr <= 0x30;
+		if (ops[i].type == WILC_REG_WRITE)
+			cmd[i] = clockless ? CMD_INTERNAL_WRITE :
+					     CMD_SINGLE_WRITE;
+		else
+			cmd[i] = clockless ? CMD_INTERNAL_READ :
+					     CMD_SINGLE_READ;
+
+		dat = cpu_to_le32(ops[i].val);
+		len[i] = spi_cmd_fill(spi_priv, wb, cmd[i], ops[i].addr,
+				      (u8 *)&dat, 4, clockless);
+		if (!len[i])
+			goto one_by_one;
+
+		len2 = spi_cmd_xfer_len(spi_priv, cmd[i], len[i]);
+		if (len2 > SPI_CMD_BUF_SZ)
+			goto one_by_one;
+		memset(&wb[len[i]], 0, len2 - len[i]);
+
+		tr[i].tx_buf = wb;
+		tr[i].rx_buf = spi_priv->batch_rb[i];
+		tr[i].len = len2;
+		tr[i].bits_per_word = 8;
+		tr[i].speed_hz = spi_priv->speed_hz;
+		/* a new command starts with CS going active again */
+		tr[i].cs_change = i < n - 1;
+		spi_message_add_tail(&tr[i], &msg);
+	}
+
+	if (spi_sync(spi, &msg) < 0) {
+		dev_err_ratelimited(&spi->dev,
+			"Failed register batch, bus error...\n");
+		wilc_spi_err_count(wilc, cmd[0], WILC_BUS_ERR_XFER);
 		wilc_spi_reset(wilc);
-		dev_warn(&spi->dev, "Reset and retry %d %x\n", retry, addr);
-		usleep_range(1000, 1100);
-		retry--;
-		if (retry)
-			goto retry;
+		return 0;
 	}
-	return result;
+
+	for (i = 0; i < n; i++) {
+		clockless = ops[i].addr <= 0x30;
+		rix = len[i];
+		if (spi_cmd_rsp_parse(wilc, cmd[i], spi_priv->batch_rb[i],
+				      &rix, tr[i].len, (u8 *)&dat,
+				      clockless) != N_OK) {
+			dev_err_ratelimited(&spi->dev,
+				"Failed register batch, op %d (%08x)\n",
+				i, ops[i].addr);
+			redo |= BIT(i);
+			continue;
+		}
+		if (ops[i].type == WILC_REG_READ)
+			ops[i].val = le32_to_cpu(dat);
+	}
+
+	if (!redo)
+		return 1;
+
+	wilc_spi_err_count(wilc, cmd[__ffs(redo)], spi_priv->err_type);
+	spi_priv->err_type = WILC_BUS_ERR_PROTO;
+	wilc_spi_reset(wilc);
+	/* sent again, a write could undo what the firmware did since */
+	for (i = 0; i < n; i++) {
+		if ((redo & BIT(i)) && ops[i].type == WILC_REG_WRITE)
+			return 0;
+	}
+
+	for (i = 0; i < n; i++) {
+		if ((redo & BIT(i)) &&
+		    !wilc_spi_read_reg(wilc, ops[i].addr, &ops[i].val))
+			return 0;
+	}
+
+	return 1;
+
+one_by_one:
+	/* nothing was sent yet */
+	for (i = 0; i < n; i++) {
+		int ret;
+
+		if (ops[i].type == WILC_REG_READ)
+			ret = wilc_spi_read_reg(wilc, ops[i].addr, &ops[i].val);
+		else
+			ret = wilc_spi_write_reg(wilc, ops[i].addr, ops[i].val);
+		if (ret != N_OK)
+			return 0;
+	}
+
+	return 1;
 }
 
 static int wilc_spi_read(struct wilc *wilc, u32 addr, u8 *buf, u32 size)
@@ -997,21 +1658,14 @@ static int wilc_spi_read(struct wilc *wilc, u32 addr, u8 *buf, u32 size)
 retry:
 	result = spi_cmd_complete(wilc, CMD_DMA_EXT_READ, addr, buf, size, 0);
 	if (result != N_OK) {
-		dev_err(&spi->dev, "Failed cmd, read block (%08x)...\n", addr);
+		dev_err_ratelimited(&spi->dev,
+			"Failed cmd, read block (%08x)...\n", addr);
 		goto fail;
 	}
 
 fail:
-	if (result != N_OK) {
-		usleep_range(1000, 1100);
-		wilc_spi_reset(wilc);
-		dev_warn(&spi->dev, "Reset and retry %d %x %d\n", retry, addr,
-			 size);
-		usleep_range(1000, 1100);
-		retry--;
-		if (retry)
-			goto retry;
-	}
+	if (wilc_spi_recover(wilc, CMD_DMA_EXT_READ, addr, result, &retry))
+		goto retry;
 	return result;
 }
 
@@ -1046,20 +1700,64 @@ static int wilc_spi_deinit(struct wilc *wilc)
 {
 	struct wilc_spi *spi_priv = wilc->bus_data;
 
-	/*
-	 * TODO:
-	 */
+	/* let a queued data phase finish before the bus goes away */
+	wait_for_completion(&spi_priv->async_done);
+	wilc_spi_async_err_count(wilc);
+	complete(&spi_priv->async_done);
 	spi_priv->is_init = false;
 
 	return 1;
 }
 
+/*
+ * Data packet size for this load: the size asked for in debugfs or else
+ * the largest one, bounded by the chip and by the controller's transfer
+ * limit since every packet goes out as one transfer. Returns 0 if the
+ * controller cannot take the smallest packet the transfers are sized for.
+ */
+static u32 wilc_spi_pkt_size(struct wilc *wilc)
+{
+	struct spi_device *spi = to_spi_device(wilc->dev);
+	u32 max = DATA_PKT_SZ;
+	u32 sz;
+
+#if KERNEL_VERSION(4, 4, 0) <= LINUX_VERSION_CODE
+	max = min_t(size_t, max, spi_max_transfer_size(spi));
+#endif
+	if (max < SPI_PKT_SZ_MIN) {
+		dev_err(&spi->dev,
+			"Controller transfers up to %u bytes, %u needed\n",
+			max, SPI_PKT_SZ_MIN);
+		return 0;
+	}
+
+	sz = wilc->bus_pkt_sz_req ? wilc->bus_pkt_sz_req : max;
+	if (sz > max) {
+		dev_warn(&spi->dev, "Packet size %u above the bus limit %u\n",
+			 sz, max);
+		sz = max;
+	}
+	/* smaller packets would need more transfers than are allocated */
+	if (sz < SPI_PKT_SZ_MIN) {
+		dev_warn(&spi->dev, "Packet size %u raised to %u\n", sz,
+			 SPI_PKT_SZ_MIN);
+		sz = SPI_PKT_SZ_MIN;
+	}
+
+	return rounddown_pow_of_two(sz);
+}
+
 static int wilc_spi_init(struct wilc *wilc, bool resume)
 {
 	struct spi_device *spi = to_spi_device(wilc->dev);
 	struct wilc_spi *spi_priv = wilc->bus_data;
 	u32 reg;
 	u32 chipid;
+	u32 pkt_sz;
+
+	/* error slowdowns only last until the next init */
+	spi_priv->speed_hz = spi_priv->max_speed_hz;
+	wilc->bus_err.speed_hz = spi_priv->speed_hz;
 
 	if (spi_priv->is_init) {
 		if (!wilc_spi_read_reg(wilc, 0x1000, &chipid)) {
@@ -1078,12 +1776,13 @@ static int wilc_spi_init(struct wilc *wilc, bool resume)
 	 * way to reset
 	 */
 	/* the SPI to it's initial value. */
-	if (!spi_internal_read(wilc, WILC_SPI_PROTOCOL_OFFSET, &reg)) {
+	if (!spi_protocol_probe(wilc, &reg)) {
 		/*
 		 * Read failed. Try with CRC off. This might happen when module
 		 * is removed but chip isn't reset
 		 */
 		spi_priv->crc_off = 1;
+		spi_priv->crc16 = false;
 		dev_err(&spi->dev,
 			"Failed read with CRC on, retrying with CRC off\n");
 		if (!spi_internal_read(wilc, WILC_SPI_PROTOCOL_OFFSET, &reg)) {
@@ -1095,18 +1794,30 @@ static int wilc_spi_init(struct wilc *wilc, bool resume)
 			return 0;
 		}
 	}
-	if (spi_priv->crc_off == 0) {
-		reg &= ~0xc; /* disable crc checking */
-		reg &= ~0x70;
-		reg |= (0x5 << 4);
-		if (!spi_internal_write(wilc, WILC_SPI_PROTOCOL_OFFSET, reg)) {
-			dev_err(&spi->dev,
-				"[wilc spi %d]: Failed internal write reg\n",
-				__LINE__);
-			return 0;
-		}
-		spi_priv->crc_off = 1;
+	/*
+	 * CRC7 on commands stays off, CRC16 on data packets only in the
+	 * integrity mode. The register is written in both cases since the
+	 * chip may still carry the setting of a previous load.
+	 */
+	reg &= ~0xc; /* disable crc checking */
+	if (spi_priv->data_crc)
+		reg |= BIT(3);
+	pkt_sz = wilc_spi_pkt_size(wilc);
+	if (!pkt_sz)
+		return 0;
+	spi_priv->pkt_sz = pkt_sz;
+	wilc->bus_pkt_sz = spi_priv->pkt_sz;
+	/* packet size field, 0 for 256 bytes up to 5 for 8K */
+	reg &= ~0x70;
+	reg |= (ilog2(spi_priv->pkt_sz) - 8) << 4;
+	if (!spi_internal_write(wilc, WILC_SPI_PROTOCOL_OFFSET, reg)) {
+		dev_err(&spi->dev,
+			"[wilc spi %d]: Failed internal write reg\n",
+			__LINE__);
+		return 0;
 	}
+	spi_priv->crc_off = 1;
+	spi_priv->crc16 = spi_priv->data_crc;
 
 	/*
 	 * make sure can read back chip id correctly
@@ -1161,12 +1872,36 @@ static int wilc_spi_clear_int_ext(struct wilc *wilc, u32 val)
 	return spi_internal_write(wilc, 0xe844 - WILC_SPI_REG_BASE, val);
 }
 
+static int wilc_spi_rx_fetch(struct wilc *wilc, u32 clear, u8 *buf,
+			     u32 size)
+{
+	struct wilc_spi *spi_priv = wilc->bus_data;
+	int result = N_FAIL;
+
+	if (!spi_priv->crc16 && size > 4 && size <= spi_priv->pkt_sz) {
+		result = spi_rx_fetch_fused(wilc, clear, buf, size);
+		if (result == N_OK)
+			return 1;
+		wilc_spi_reset(wilc);
+	}
+
+	/* separate clear and read commands, each with its own retries */
+	if (result != N_RETRY && !wilc_spi_clear_int_ext(wilc, clear))
+		return 0;
+
+	return wilc_spi_read(wilc, 0, buf, size);
+}
+
 static int wilc_spi_sync_ext(struct wilc *wilc, int nint)
 {
 	struct spi_device *spi = to_spi_device(wilc->dev);
 	struct wilc_spi *spi_priv = wilc->bus_data;
-	u32 reg;
-	int ret, i;
+	struct wilc_reg_op ops[3] = {
+		{ WILC_REG_READ, WILC_PIN_MUX_0 },
+		{ WILC_REG_READ, WILC_INTR_ENABLE },
+		{ WILC_REG_READ, WILC_INTR2_ENABLE },
+	};
+	int n, i;
 
 	if (nint > MAX_NUM_INT) {
 		dev_err(&spi->dev, "Too many interrupts (%d)...\n", nint);
@@ -1174,60 +1909,35 @@ static int wilc_spi_sync_ext(struct wilc *wilc, int nint)
 	}
 
 	spi_priv->nint = nint;
+	/* the second enable register only serves interrupts above five */
+	n = nint > 5 ? 3 : 2;
+
+	if (!wilc_spi_reg_batch(wilc, ops, n)) {
+		dev_err(&spi->dev, "Failed read of interrupt setup regs...\n");
+		return 0;
+	}
 
 	/*
 	 * interrupt pin mux select
 	 */
-	ret = wilc_spi_read_reg(wilc, WILC_PIN_MUX_0, &reg);
-	if (!ret) {
-		dev_err(&spi->dev, "Failed read reg (%08x)...\n",
-			WILC_PIN_MUX_0);
-		return 0;
-	}
-	reg |= BIT(8);
-	ret = wilc_spi_write_reg(wilc, WILC_PIN_MUX_0, reg);
-	if (!ret) {
-		dev_err(&spi->dev, "Failed write reg (%08x)...\n",
-			WILC_PIN_MUX_0);
-		return 0;
-	}
+	ops[0].val |= BIT(8);
 
 	/*
 	 * interrupt enable
 	 */
-	ret = wilc_spi_read_reg(wilc, WILC_INTR_ENABLE, &reg);
-	if (!ret) {
-		dev_err(&spi->dev, "Failed read reg (%08x)...\n",
-			WILC_INTR_ENABLE);
-		return 0;
-	}
-
 	for (i = 0; (i < 5) && (nint > 0); i++, nint--)
-		reg |= (BIT((27 + i)));
+		ops[1].val |= (BIT((27 + i)));
 
-	ret = wilc_spi_write_reg(wilc, WILC_INTR_ENABLE, reg);
-	if (!ret) {
-		dev_err(&spi->dev, "Failed write reg (%08x)...\n",
-			WILC_INTR_ENABLE);
-		return 0;
-	}
-	if (nint) {
-		ret = wilc_spi_read_reg(wilc, WILC_INTR2_ENABLE, &reg);
-		if (!ret) {
-			dev_err(&spi->dev, "Failed read reg (%08x)...\n",
-				WILC_INTR2_ENABLE);
-			return 0;
-		}
+	for (i = 0; (i < 3) && (nint > 0); i++, nint--)
+		ops[2].val |= BIT(i);
 
-		for (i = 0; (i < 3) && (nint > 0); i++, nint--)
-			reg |= BIT(i);
+	for (i = 0; i < n; i++)
+		ops[i].type = WILC_REG_WRITE;
 
-		ret = wilc_spi_write_reg(wilc, WILC_INTR2_ENABLE, reg);
-		if (!ret) {
-			dev_err(&spi->dev, "Failed write reg (%08x)...\n",
-				WILC_INTR2_ENABLE);
-			return 0;
-		}
+	if (!wilc_spi_reg_batch(wilc, ops, n)) {
+		dev_err(&spi->dev,
+			"Failed write of interrupt setup regs...\n");
+		return 0;
 	}
 
 	return 1;
@@ -1246,6 +1956,10 @@ static const struct wilc_hif_func wilc_hif_spi = {
 	.hif_read_size = wilc_spi_read_size,
 	.hif_block_tx_ext = wilc_spi_write,
 	.hif_block_rx_ext = wilc_spi_read,
+	.hif_rx_fetch = wilc_spi_rx_fetch,
+	.hif_reg_batch = wilc_spi_reg_batch,
+	.hif_block_tx_ext_sg = wilc_spi_write_sg,
+	.hif_block_tx_ext_async = wilc_spi_write_sg_async,
 	.hif_sync_ext = wilc_spi_sync_ext,
 	.hif_reset = wilc_spi_reset,
 	.hif_is_init = wilc_spi_is_init,
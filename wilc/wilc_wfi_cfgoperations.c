@@ -1827,6 +1827,7 @@ static int change_virtual_intf(struct wiphy *wiphy, struct net_device *dev,
 		PRINT_ER(dev, "Unknown interface type= %d\n", type);
 		return -EINVAL;
 	}
+	wilc_rx_map_update(wl);
 
 	return 0;
 }
@@ -2181,6 +2182,7 @@ static int del_virtual_intf(struct wiphy *wiphy, struct wireless_dev *wdev)
 	list_del_rcu(&vif->list);
 	wl->vif_num--;
 	mutex_unlock(&wl->vif_mutex);
+	wilc_rx_map_update(wl);
 	synchronize_srcu(&wl->srcu);
 	return 0;
 }
@@ -2341,7 +2343,6 @@ static void wlan_init_locks(struct wilc *wl)
 {
 	pr_info("Initializing Locks ...\n");
 	mutex_init(&wl->vif_mutex);
-	mutex_init(&wl->rxq_cs);
 	mutex_init(&wl->cfg_cmd_lock);
 	mutex_init(&wl->deinit_lock);
 	mutex_init(&wl->hif_cs);
@@ -2357,13 +2358,13 @@ static void wlan_init_locks(struct wilc *wl)
 	init_completion(&wl->txq_thread_started);
 	init_completion(&wl->debug_thread_started);
 	init_srcu_struct(&wl->srcu);
+	seqlock_init(&wl->rx_map.lock);
 }
 
 void wlan_deinit_locks(struct wilc *wl)
 {
 	pr_info("De-Initializing Locks\n");
 	mutex_destroy(&wl->hif_cs);
-	mutex_destroy(&wl->rxq_cs);
 	mutex_destroy(&wl->cfg_cmd_lock);
 	mutex_destroy(&wl->vif_mutex);
 	mutex_destroy(&wl->txq_add_to_head_cs);
@@ -2391,21 +2392,54 @@ int wilc_cfg80211_init(struct wilc **wilc, struct device *dev, int io_type,
 	if (ret)
 		goto free_wl;
 
-	wilc_debugfs_init();
+	snprintf(wl->txq_cache_name, sizeof(wl->txq_cache_name),
+		 "wilc_txq_entry-%s", dev_name(dev));
+	wl->txq_cache = kmem_cache_create(wl->txq_cache_name,
+					  sizeof(struct txq_entry_t), 0, 0,
+					  NULL);
+	if (!wl->txq_cache) {
+		ret = -ENOMEM;
+		goto free_cfg;
+	}
+
+	ret = wilc_napi_init(wl);
+	if (ret)
+		goto free_txq_cache;
+
+	wilc_debugfs_init(wl, dev);
 	*wilc = wl;
 	wl->io_type = io_type;
 	wl->hif_func = ops;
-	for (i = 0; i < NQUEUES; i++)
+	for (i = 0; i < NQUEUES; i++) {
 		INIT_LIST_HEAD(&wl->txq[i].txq_head.list);
+		init_llist_head(&wl->txq[i].stage);
+		skb_queue_head_init(&wl->txq[i].skb_head);
+		atomic_set(&wl->txq[i].count, 0);
+		memset(&wl->txq[i].codel, 0, sizeof(wl->txq[i].codel));
+	}
+	atomic_set(&wl->txq_entries, 0);
+	wilc_wlan_tx_sched_init(wl);
 
-	INIT_LIST_HEAD(&wl->rxq_head.list);
 	INIT_LIST_HEAD(&wl->vif_list);
+	wilc_irq_mod_init(wl);
 
 	wl->hif_workqueue = create_singlethread_workqueue("WILC_wq");
 	if (!wl->hif_workqueue) {
 		ret = -ENOMEM;
 		goto free_debug_fs;
 	}
+
+	wl->tx_workqueue = create_singlethread_workqueue("WILC_tx_wq");
+	if (!wl->tx_workqueue) {
+		ret = -ENOMEM;
+		goto free_hif_wq;
+	}
+	for (i = 0; i < WILC_TX_SLOTS; i++) {
+		wl->tx_slot[i].wilc = wl;
+		INIT_WORK(&wl->tx_slot[i].work, wilc_wlan_tx_slot_work);
+		init_completion(&wl->tx_slot[i].done);
+		complete_all(&wl->tx_slot[i].done);
+	}
 	vif = wilc_netdev_ifc_init(wl, "wlan%d", WILC_STATION_MODE,
 				   NL80211_IFTYPE_STATION, false);
 	if (IS_ERR(vif)) {
@@ -2417,9 +2451,15 @@ int wilc_cfg80211_init(struct wilc **wilc, struct device *dev, int io_type,
 
 	return 0;
 free_wq:
+	destroy_workqueue(wl->tx_workqueue);
+free_hif_wq:
 	destroy_workqueue(wl->hif_workqueue);
 free_debug_fs:
-	wilc_debugfs_remove();
+	wilc_debugfs_remove(wl);
+	wilc_napi_deinit(wl);
+free_txq_cache:
+	kmem_cache_destroy(wl->txq_cache);
+free_cfg:
 	cfg_deinit(wl);
 free_wl:
 	wlan_deinit_locks(wl);
@@ -190,29 +190,39 @@ struct frame_reg {
 	bool reg;
 };
 
-#define MAX_TCP_SESSION                25
-#define MAX_PENDING_ACKS               256
-
-struct ack_session_info {
-	u32 seq_num;
-	u32 bigger_ack_num;
-	u16 src_port;
-	u16 dst_port;
-	u16 status;
+#define WILC_ACK_FLOW_HASH_BITS	6
+#define WILC_ACK_FLOW_BUCKETS	BIT(WILC_ACK_FLOW_HASH_BITS)
+#define WILC_ACK_FLOWS		128
+
+/* TCP 4-tuple, IPv4 addresses use the first word only */
+struct wilc_ack_flow_key {
+	__be32 saddr[4];
+	__be32 daddr[4];
+	__be16 sport;
+	__be16 dport;
+	u16 family;
+	u16 pad;
 };
 
-struct pending_acks {
+struct wilc_ack_flow {
+	struct hlist_node node;
+	struct list_head lru;
+	struct wilc_ack_flow_key key;
 	u32 ack_num;
-	u32 session_index;
-	struct txq_entry_t  *txqe;
+	/* newest pure ACK of the flow still waiting in the TX queue */
+	struct sk_buff *skb;
 };
 
 struct tcp_ack_filter {
-	struct ack_session_info ack_session_info[2 * MAX_TCP_SESSION];
-	struct pending_acks pending_acks[MAX_PENDING_ACKS];
-	u32 pending_base;
-	u32 tcp_session;
-	u32 pending_acks_idx;
+	/* protects the flow table and the ACK state of queued frames */
+	spinlock_t lock;
+	struct hlist_head hash[WILC_ACK_FLOW_BUCKETS];
+	/* most recently used flow first, the tail is recycled when full */
+	struct list_head lru;
+	struct wilc_ack_flow flows[WILC_ACK_FLOWS];
+	/* ACKs overwritten in place / dropped at dequeue, for debugfs */
+	u32 replaced;
+	u32 dropped;
 	bool enabled;
 };
 
@@ -238,6 +248,8 @@ struct wilc_vif {
 	struct rf_info periodic_stats;
 	struct timer_list periodic_rssi;
 	struct tcp_ack_filter ack_filter;
+	/* net frames charged to BQL and not completed yet */
+	atomic_t tx_queued;
 	bool connecting;
 	struct wilc_priv priv;
 	struct list_head list;
@@ -246,6 +258,61 @@ struct wilc_vif {
 	struct cfg80211_bss *bss;
 };
 
+/* frames whose BSSID at @offset matches @bssid belong to @vif */
+struct wilc_rx_map_entry {
+	u8 bssid[ETH_ALEN];
+	u8 offset;
+	struct wilc_vif *vif;
+};
+
+/*
+ * RX demux table, rebuilt whenever a vif changes BSSID, mode or goes away.
+ * Readers hold srcu for the vif pointers and retry on a concurrent update.
+ */
+struct wilc_rx_map {
+	seqlock_t lock;
+	struct wilc_rx_map_entry ent[WILC_NUM_CONCURRENT_IFC];
+	u8 num;
+	/* receives the frames no entry matches */
+	struct wilc_vif *monitor;
+};
+
+struct wilc_rx_stats {
+	/* data frames no interface matched */
+	u32 demux_miss;
+	/* interrupt mitigation */
+	u32 irqs;
+	u32 polls;
+	u32 to_poll;
+	u32 to_irq;
+	u64 irq_mode_ns;
+	u64 poll_mode_ns;
+};
+
+#define WILC_IRQ_RATE_WINDOW_NS		(10 * NSEC_PER_MSEC)
+/* interrupts per window above which RX switches to polling */
+#define WILC_IRQ_POLL_THRESH		20
+#define WILC_POLL_INTERVAL_NS		(250 * NSEC_PER_USEC)
+/* consecutive empty polls before going back to interrupts */
+#define WILC_POLL_IDLE_EXIT		40
+
+/*
+ * Under a high interrupt rate the GPIO interrupt is disabled and the
+ * interrupt status is polled from a timer until the chip goes idle.
+ */
+struct wilc_irq_mod {
+	struct hrtimer timer;
+	struct work_struct work;
+	bool polling;
+	/* set while the IRQ is torn down, no switch to polling then */
+	bool stop;
+	ktime_t window_start;
+	u32 window_irqs;
+	u32 idle_polls;
+	/* start of the current mode, for the residency statistics */
+	ktime_t mode_since;
+};
+
 struct wilc {
 	struct wiphy *wiphy;
 	const struct wilc_hif_func *hif_func;
@@ -270,8 +337,6 @@ struct wilc {
 	struct mutex txq_add_to_head_cs;
 	/*protect txq_entry_t transmit queue*/
 	spinlock_t txq_spinlock;
-	/*protect rxq_entry_t receiver queue*/
-	struct mutex rxq_cs;
 	/* lock to protect hif access */
 	struct mutex hif_cs;
 
@@ -291,13 +356,35 @@ struct wilc {
 	u8 cfg_seq_no;
 
 	u8 *rx_buffer;
-	u32 rx_buffer_offset;
-	u8 *tx_buffer;
+	struct wilc_rx_ring rx_ring;
+	struct wilc_rx_map rx_map;
+	struct wilc_rx_stats rx_stats;
+	/* rx_stats when debugfs last cleared them, the writers take no lock */
+	struct wilc_rx_stats rx_stats_base;
+	struct wilc_irq_mod irq_mod;
+	/* received net frames are delivered to the stack from NAPI */
+	struct net_device *napi_dev;
+	struct napi_struct napi;
+	struct sk_buff_head rx_napi_queue;
+	struct wilc_tx_slot tx_slot[WILC_TX_SLOTS];
+	u8 tx_slot_idx;
+	struct workqueue_struct *tx_workqueue;
+	struct wilc_tx_stats tx_stats;
+	struct wilc_bus_err_stats bus_err;
+	struct wilc_reg_cache reg_cache;
+	/* bus data packet size in use, and the one asked for in debugfs */
+	u32 bus_pkt_sz;
+	u32 bus_pkt_sz_req;
+	ktime_t tx_bus_idle_since;
+	/* per device debugfs directory, below the driver's one */
+	struct dentry *debugfs_dir;
+	struct kmem_cache *txq_cache;
+	/* per device, slab names show up in sysfs */
+	char txq_cache_name[32];
 
 	struct txq_handle txq[NQUEUES];
-	int txq_entries;
-
-	struct rxq_entry_t rxq_head;
+	atomic_t txq_entries;
+	struct wilc_tx_sched tx_sched;
 
 	const struct firmware *firmware;
 
@@ -331,9 +418,16 @@ struct wilc_wfi_mon_priv {
 
 void wilc_frmw_to_host(struct wilc_vif *vif, u8 *buff, u32 size,
 		       u32 pkt_offset, u8 status);
+void wilc_frmw_to_host_page(struct wilc_vif *vif, struct page *page,
+			    u8 *buff, u32 size, u32 pkt_offset);
+void wilc_rx_napi_schedule(struct wilc *wilc);
+int wilc_napi_init(struct wilc *wilc);
+void wilc_napi_deinit(struct wilc *wilc);
 void wilc_mac_indicate(struct wilc *wilc);
 void wilc_netdev_cleanup(struct wilc *wilc);
 void wilc_wfi_mgmt_rx(struct wilc *wilc, u8 *buff, u32 size);
 void wilc_wlan_set_bssid(struct net_device *wilc_netdev, u8 *bssid, u8 mode);
+void wilc_rx_map_update(struct wilc *wilc);
+void wilc_irq_mod_init(struct wilc *wilc);
 
 #endif
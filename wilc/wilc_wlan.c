@@ -7,6 +7,10 @@
 #include <linux/etherdevice.h>
 #include <linux/if_ether.h>
 #include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/jhash.h>
+#include <net/inet_ecn.h>
+#include <net/tcp.h>
 
 #include "wilc_wfi_netdevice.h"
 #include "wilc_wlan_cfg.h"
@@ -15,11 +19,6 @@
 
 #define WAKUP_TRAILS_TIMEOUT		(10000)
 
-#if KERNEL_VERSION(3, 12, 21) > LINUX_VERSION_CODE
-#define list_next_entry(pos, member) \
-	list_entry((pos)->member.next, typeof(*(pos)), member)
-#endif
-
 void acquire_bus(struct wilc *wilc, enum bus_acquire acquire, int source)
 {
 	mutex_lock(&wilc->hif_cs);
@@ -43,253 +42,574 @@ uint8_t reset_bus(struct wilc *wilc)
 	return ret;
 }
 
-static void wilc_wlan_txq_remove(struct wilc *wilc, u8 q_num,
-				 struct txq_entry_t *tqe)
+#if KERNEL_VERSION(3, 14, 0) > LINUX_VERSION_CODE
+static struct llist_node *llist_reverse_order(struct llist_node *head)
 {
-	list_del(&tqe->list);
-	wilc->txq_entries -= 1;
-	wilc->txq[q_num].count--;
+	struct llist_node *new_head = NULL;
+
+	while (head) {
+		struct llist_node *tmp = head;
+
+		head = head->next;
+		tmp->next = new_head;
+		new_head = tmp;
+	}
+
+	return new_head;
 }
+#endif
 
-static struct txq_entry_t *
-wilc_wlan_txq_remove_from_head(struct wilc *wilc, u8 q_num)
+static inline struct sk_buff *wilc_wlan_node_to_skb(struct llist_node *node)
 {
-	struct txq_entry_t *tqe = NULL;
-	unsigned long flags;
+	struct wilc_skb_tx_cb *cb = container_of(node, struct wilc_skb_tx_cb,
+						 node);
 
-	spin_lock_irqsave(&wilc->txq_spinlock, flags);
+	return container_of((void *)cb, struct sk_buff, cb);
+}
 
-	if (!list_empty(&wilc->txq[q_num].txq_head.list)) {
-		tqe = list_first_entry(&wilc->txq[q_num].txq_head.list,
-				       struct txq_entry_t, list);
-		list_del(&tqe->list);
-		wilc->txq_entries -= 1;
-		wilc->txq[q_num].count--;
+static inline void wilc_wlan_txq_dec(struct wilc *wilc, u8 q_num)
+{
+	atomic_dec(&wilc->txq_entries);
+	atomic_dec(&wilc->txq[q_num].count);
+}
+
+static inline int wilc_wlan_txq_inc(struct wilc *wilc, u8 q_num)
+{
+	atomic_inc(&wilc->txq[q_num].count);
+	return atomic_inc_return(&wilc->txq_entries);
+}
+
+/*
+ * Move what the senders pushed to the stage onto the ordered skb queue.
+ * Only the TX thread (or cleanup, once it is stopped) calls this, so
+ * skb_head needs no lock.
+ */
+static void wilc_wlan_txq_drain_stage(struct wilc *wilc, u8 q_num)
+{
+	struct llist_node *node;
+	struct sk_buff *skb;
+
+	node = llist_del_all(&wilc->txq[q_num].stage);
+	node = llist_reverse_order(node);
+	while (node) {
+		skb = wilc_wlan_node_to_skb(node);
+		node = node->next;
+		__skb_queue_tail(&wilc->txq[q_num].skb_head, skb);
 	}
-	spin_unlock_irqrestore(&wilc->txq_spinlock, flags);
-	return tqe;
 }
 
-static void wilc_wlan_txq_add_to_tail(struct net_device *dev, u8 q_num,
-				      struct txq_entry_t *tqe)
+void wilc_ack_filter_init(struct tcp_ack_filter *f)
 {
-	unsigned long flags;
-	struct wilc_vif *vif = netdev_priv(dev);
-	struct wilc *wilc = vif->wilc;
+	int i;
 
-	spin_lock_irqsave(&wilc->txq_spinlock, flags);
+	spin_lock_init(&f->lock);
+	for (i = 0; i < WILC_ACK_FLOW_BUCKETS; i++)
+		INIT_HLIST_HEAD(&f->hash[i]);
+	INIT_LIST_HEAD(&f->lru);
+	f->replaced = 0;
+	f->dropped = 0;
+	for (i = 0; i < WILC_ACK_FLOWS; i++) {
+		INIT_HLIST_NODE(&f->flows[i].node);
+		list_add_tail(&f->flows[i].lru, &f->lru);
+		f->flows[i].skb = NULL;
+	}
+}
 
-	list_add_tail(&tqe->list, &wilc->txq[q_num].txq_head.list);
-	wilc->txq_entries += 1;
-	wilc->txq[q_num].count++;
-	PRINT_INFO(vif->ndev, TX_DBG, "Number of entries in TxQ = %d\n",
-		   wilc->txq_entries);
+/* look up the flow of @key, recycling the least recently used one if new */
+static struct wilc_ack_flow *
+wilc_ack_flow_get(struct tcp_ack_filter *f, const struct wilc_ack_flow_key *key)
+{
+	struct wilc_ack_flow *flow;
+	u32 hash;
 
-	spin_unlock_irqrestore(&wilc->txq_spinlock, flags);
+	hash = jhash(key, sizeof(*key), 0) & (WILC_ACK_FLOW_BUCKETS - 1);
+	hlist_for_each_entry(flow, &f->hash[hash], node) {
+		if (!memcmp(&flow->key, key, sizeof(*key)))
+			goto found;
+	}
 
-	PRINT_INFO(vif->ndev, TX_DBG, "Wake the txq_handling\n");
-	complete(&wilc->txq_event);
+	flow = list_last_entry(&f->lru, struct wilc_ack_flow, lru);
+	if (!hlist_unhashed(&flow->node))
+		hlist_del_init(&flow->node);
+	if (flow->skb) {
+		WILC_SKB_TX_CB(flow->skb)->ack_flow = NULL;
+		flow->skb = NULL;
+	}
+	flow->key = *key;
+	flow->ack_num = 0;
+	hlist_add_head(&flow->node, &f->hash[hash]);
+
+found:
+	list_move(&flow->lru, &f->lru);
+	return flow;
 }
 
-static void wilc_wlan_txq_add_to_head(struct wilc_vif *vif, u8 q_num,
-				     struct txq_entry_t *tqe)
+/*
+ * Track pure TCP ACKs per 4-tuple. A newer cumulative ACK of a flow whose
+ * older ACK is still queued is copied over it in place, so it keeps the
+ * older queue position and the new skb is not queued at all; true is then
+ * returned and the caller frees @skb. If the frames differ in length the
+ * old one is only marked superseded and dropped when the TX thread dequeues
+ * it. Duplicate ACKs are kept, TCP needs them for fast retransmit. Called
+ * with f->lock held.
+ */
+static bool tcp_process(struct wilc_vif *vif, struct sk_buff *skb)
 {
+	struct tcp_ack_filter *f = &vif->ack_filter;
+	const struct ethhdr *eth_hdr_ptr = (void *)skb->data;
+	u8 *l3 = skb->data + ETH_HLEN;
+	struct wilc_ack_flow_key key;
+	struct wilc_ack_flow *flow;
+	const struct tcphdr *tcp_hdr_ptr;
+	u32 ihl, tot_len, tcp_len, ack_no;
+
+	memset(&key, 0, sizeof(key));
+	if (eth_hdr_ptr->h_proto == htons(ETH_P_IP)) {
+		const struct iphdr *ip_hdr_ptr = (void *)l3;
+
+		if (skb->len < ETH_HLEN + sizeof(*ip_hdr_ptr) ||
+		    ip_hdr_ptr->protocol != IPPROTO_TCP ||
+		    ip_hdr_ptr->frag_off & htons(IP_MF | IP_OFFSET))
+			return false;
+		/* forwarded frames are not trusted to have a sane header */
+		ihl = ip_hdr_ptr->ihl << 2;
+		tot_len = ntohs(ip_hdr_ptr->tot_len);
+		if (ihl < sizeof(*ip_hdr_ptr) || tot_len < ihl ||
+		    tot_len > skb->len - ETH_HLEN)
+			return false;
+		tcp_len = tot_len - ihl;
+		key.saddr[0] = ip_hdr_ptr->saddr;
+		key.daddr[0] = ip_hdr_ptr->daddr;
+	} else if (eth_hdr_ptr->h_proto == htons(ETH_P_IPV6)) {
+		const struct ipv6hdr *ip6_hdr_ptr = (void *)l3;
+
+		/* extension headers are not followed */
+		if (skb->len < ETH_HLEN + sizeof(*ip6_hdr_ptr) ||
+		    ip6_hdr_ptr->nexthdr != IPPROTO_TCP)
+			return false;
+		ihl = sizeof(*ip6_hdr_ptr);
+		tcp_len = ntohs(ip6_hdr_ptr->payload_len);
+		if (tcp_len > skb->len - ETH_HLEN - ihl)
+			return false;
+		memcpy(key.saddr, &ip6_hdr_ptr->saddr, sizeof(key.saddr));
+		memcpy(key.daddr, &ip6_hdr_ptr->daddr, sizeof(key.daddr));
+	} else {
+		return false;
+	}
+
+	if (skb->len < ETH_HLEN + ihl + sizeof(*tcp_hdr_ptr))
+		return false;
+	tcp_hdr_ptr = (void *)(l3 + ihl);
+
+	/* pure ACK: no payload and no control flag besides ACK/PSH */
+	if (tcp_len != tcp_hdr_ptr->doff << 2 || !tcp_hdr_ptr->ack ||
+	    tcp_hdr_ptr->syn || tcp_hdr_ptr->fin || tcp_hdr_ptr->rst ||
+	    tcp_hdr_ptr->urg)
+		return false;
+
+	key.family = ntohs(eth_hdr_ptr->h_proto);
+	key.sport = tcp_hdr_ptr->source;
+	key.dport = tcp_hdr_ptr->dest;
+	ack_no = ntohl(tcp_hdr_ptr->ack_seq);
+
+	flow = wilc_ack_flow_get(f, &key);
+	if (flow->skb) {
+		struct sk_buff *old_skb = flow->skb;
+		struct wilc_skb_tx_cb *old = WILC_SKB_TX_CB(old_skb);
+
+		if (after(ack_no, flow->ack_num)) {
+			if (old_skb->len == skb->len &&
+			    old->q_num == WILC_SKB_TX_CB(skb)->q_num &&
+			    !skb_cloned(old_skb)) {
+				PRINT_INFO(vif->ndev, TCP_ENH,
+					   "REPLACE ACK: %u -> %u\n",
+					   flow->ack_num, ack_no);
+				memcpy(old_skb->data, skb->data, skb->len);
+				flow->ack_num = ack_no;
+				f->replaced++;
+				return true;
+			}
+			PRINT_INFO(vif->ndev, TCP_ENH, "DROP ACK: %u\n",
+				   flow->ack_num);
+			old->ack_superseded = true;
+			f->dropped++;
+		}
+		old->ack_flow = NULL;
+	}
+	flow->skb = skb;
+	flow->ack_num = ack_no;
+	WILC_SKB_TX_CB(skb)->ack_flow = flow;
+
+	return false;
+}
+
+/*
+ * Detach a dequeued net frame from the ACK filter. Returns false if a newer
+ * ACK of the same flow superseded it, the caller then drops it.
+ */
+static bool wilc_wlan_ack_dequeue(struct sk_buff *skb)
+{
+	struct wilc_skb_tx_cb *cb = WILC_SKB_TX_CB(skb);
+	struct tcp_ack_filter *f = &cb->vif->ack_filter;
 	unsigned long flags;
-	struct wilc *wilc = vif->wilc;
+	bool superseded;
 
-	mutex_lock(&wilc->txq_add_to_head_cs);
+	spin_lock_irqsave(&f->lock, flags);
+	if (cb->ack_flow) {
+		cb->ack_flow->skb = NULL;
+		cb->ack_flow = NULL;
+	}
+	superseded = cb->ack_superseded;
+	spin_unlock_irqrestore(&f->lock, flags);
 
-	spin_lock_irqsave(&wilc->txq_spinlock, flags);
+	return !superseded;
+}
 
-	list_add(&tqe->list, &wilc->txq[q_num].txq_head.list);
-	wilc->txq_entries += 1;
-	wilc->txq[q_num].count++;
-	PRINT_INFO(vif->ndev, TX_DBG, "Number of entries in TxQ = %d\n",
-		   wilc->txq_entries);
+/*
+ * Byte queue limits: bytes are charged to the netdev TX queue of a frame when
+ * it is queued and released once the chip accepted it, or it was dropped.
+ */
+static inline struct netdev_queue *wilc_wlan_skb_txq(struct sk_buff *skb)
+{
+	return netdev_get_tx_queue(WILC_SKB_TX_CB(skb)->vif->ndev,
+				   skb_get_queue_mapping(skb));
+}
 
-	spin_unlock_irqrestore(&wilc->txq_spinlock, flags);
-	mutex_unlock(&wilc->txq_add_to_head_cs);
-	complete(&wilc->txq_event);
-	PRINT_INFO(vif->ndev, TX_DBG, "Wake up the txq_handler\n");
+static inline void wilc_wlan_bql_sent(struct sk_buff *skb)
+{
+	atomic_inc(&WILC_SKB_TX_CB(skb)->vif->tx_queued);
+	netdev_tx_sent_queue(wilc_wlan_skb_txq(skb), skb->len);
 }
 
-#define NOT_TCP_ACK			(-1)
+static void wilc_wlan_bql_completed(struct sk_buff *skb)
+{
+	netdev_tx_completed_queue(wilc_wlan_skb_txq(skb), 1, skb->len);
+	atomic_dec(&WILC_SKB_TX_CB(skb)->vif->tx_queued);
+}
 
-static inline void add_tcp_session(struct wilc_vif *vif, u32 src_prt,
-				  u32 dst_prt, u32 seq)
+/* release the frames the chip accepted, one call per run of the same queue */
+static void wilc_wlan_tx_bql_batch(struct wilc_tx_slot *slot, int entries)
 {
-	struct tcp_ack_filter *f = &vif->ack_filter;
+	struct netdev_queue *txq = NULL, *cur;
+	unsigned int pkts = 0, bytes = 0;
+	struct sk_buff *skb;
+	int i;
 
-	if (f->tcp_session < 2 * MAX_TCP_SESSION) {
-		f->ack_session_info[f->tcp_session].seq_num = seq;
-		f->ack_session_info[f->tcp_session].bigger_ack_num = 0;
-		f->ack_session_info[f->tcp_session].src_port = src_prt;
-		f->ack_session_info[f->tcp_session].dst_port = dst_prt;
-		f->tcp_session++;
-		PRINT_INFO(vif->ndev, TCP_ENH, "TCP Session %d to Ack %d\n",
-			   f->tcp_session, seq);
+	for (i = 0; i < entries; i++) {
+		if (slot->batch.tqe[i]->type != WILC_NET_PKT)
+			continue;
+		skb = slot->batch.tqe[i]->priv;
+		cur = wilc_wlan_skb_txq(skb);
+		if (cur != txq) {
+			if (txq)
+				netdev_tx_completed_queue(txq, pkts, bytes);
+			txq = cur;
+			pkts = 0;
+			bytes = 0;
+		}
+		pkts++;
+		bytes += skb->len;
+		atomic_dec(&WILC_SKB_TX_CB(skb)->vif->tx_queued);
 	}
+	if (txq)
+		netdev_tx_completed_queue(txq, pkts, bytes);
 }
 
-static inline void update_tcp_session(struct wilc_vif *vif, u32 index, u32 ack)
+static u64 wilc_codel_control_law(u64 t, u32 count)
 {
-	struct tcp_ack_filter *f = &vif->ack_filter;
+	return t + div_u64(WILC_CODEL_INTERVAL_NS, int_sqrt(count));
+}
 
-	if (index < 2 * MAX_TCP_SESSION &&
-	    ack > f->ack_session_info[index].bigger_ack_num)
-		f->ack_session_info[index].bigger_ack_num = ack;
+static bool wilc_codel_ok_to_drop(struct wilc *wilc, u8 q_num, u64 sojourn,
+				  u64 now)
+{
+	struct wilc_codel *c = &wilc->txq[q_num].codel;
+
+	/* never drop the last frame, nor while the delay is below target */
+	if (sojourn < WILC_CODEL_TARGET_NS ||
+	    !atomic_read(&wilc->txq[q_num].count)) {
+		c->first_above_ns = 0;
+		return false;
+	}
+	if (!c->first_above_ns) {
+		c->first_above_ns = now + WILC_CODEL_INTERVAL_NS;
+		return false;
+	}
+
+	return now >= c->first_above_ns;
 }
 
-static inline void add_tcp_pending_ack(struct wilc_vif *vif, u32 ack,
-				      u32 session_index,
-				      struct txq_entry_t *txqe)
+/*
+ * CoDel (RFC 8289) on a dequeued net frame. Returns true if the frame has
+ * to be dropped; ECN capable frames are marked CE instead.
+ */
+static bool wilc_codel_should_drop(struct wilc *wilc, u8 q_num,
+				   struct sk_buff *skb)
 {
-	struct tcp_ack_filter *f = &vif->ack_filter;
-	u32 i = f->pending_base + f->pending_acks_idx;
+	struct wilc_codel *c = &wilc->txq[q_num].codel;
+	u64 now = ktime_to_ns(ktime_get());
+	u64 sojourn = now - WILC_SKB_TX_CB(skb)->enqueue_ns;
+	bool drop = false, ok;
+
+	c->packets++;
+	c->sojourn_sum_ns += sojourn;
+	if (sojourn > c->sojourn_max_ns)
+		c->sojourn_max_ns = sojourn;
+
+	ok = wilc_codel_ok_to_drop(wilc, q_num, sojourn, now);
+	if (c->dropping) {
+		if (!ok) {
+			c->dropping = false;
+		} else if (now >= c->drop_next_ns) {
+			drop = true;
+			c->count++;
+			c->drop_next_ns = wilc_codel_control_law(c->drop_next_ns,
+								 c->count);
+		}
+	} else if (ok &&
+		   (now - c->drop_next_ns < WILC_CODEL_INTERVAL_NS ||
+		    now - c->first_above_ns >= WILC_CODEL_INTERVAL_NS)) {
+		u32 delta = c->count - c->lastcount;
+
+		drop = true;
+		c->dropping = true;
+		/* resume near the last drop rate if dropping stopped briefly */
+		if (delta > 1 &&
+		    now - c->drop_next_ns < 16 * WILC_CODEL_INTERVAL_NS)
+			c->count = delta;
+		else
+			c->count = 1;
+		c->lastcount = c->count;
+		c->drop_next_ns = wilc_codel_control_law(now, c->count);
+	}
 
-	if (i < MAX_PENDING_ACKS) {
-		f->pending_acks[i].ack_num = ack;
-		f->pending_acks[i].txqe = txqe;
-		f->pending_acks[i].session_index = session_index;
-		txqe->ack_idx = i;
-		f->pending_acks_idx++;
+	if (!drop)
+		return false;
+	if (INET_ECN_set_ce(skb)) {
+		c->marks++;
+		return false;
 	}
+	c->drops++;
+	return true;
 }
 
-static inline void tcp_process(struct net_device *dev, struct txq_entry_t *tqe)
+static void wilc_wlan_skb_to_tqe(struct sk_buff *skb, struct txq_entry_t *tqe)
 {
-	void *buffer = tqe->buffer;
-	const struct ethhdr *eth_hdr_ptr = buffer;
-	int i;
+	struct wilc_skb_tx_cb *cb = WILC_SKB_TX_CB(skb);
+
+	tqe->type = WILC_NET_PKT;
+	tqe->buffer = skb->data;
+	tqe->buffer_size = skb->len;
+	tqe->priv = skb;
+	tqe->tx_complete_func = NULL;
+	tqe->q_num = cb->q_num;
+	tqe->vif = cb->vif;
+}
+
+/*
+ * cfg and mgmt frames are taken before net frames. A dequeued net frame is
+ * described by @net_tqe, which the caller provides.
+ */
+static struct txq_entry_t *
+wilc_wlan_txq_remove_from_head(struct wilc *wilc, u8 q_num,
+			       struct txq_entry_t *net_tqe)
+{
+	struct txq_entry_t *tqe = NULL;
+	struct sk_buff *skb;
 	unsigned long flags;
-	struct wilc_vif *vif = netdev_priv(dev);
-	struct wilc *wilc = vif->wilc;
-	struct tcp_ack_filter *f = &vif->ack_filter;
-	const struct iphdr *ip_hdr_ptr;
-	const struct tcphdr *tcp_hdr_ptr;
-	u32 ihl, total_length, data_offset;
 
-	spin_lock_irqsave(&wilc->txq_spinlock, flags);
+	if (!list_empty(&wilc->txq[q_num].txq_head.list)) {
+		spin_lock_irqsave(&wilc->txq_spinlock, flags);
+		tqe = list_first_entry_or_null(&wilc->txq[q_num].txq_head.list,
+					       struct txq_entry_t, list);
+		if (tqe)
+			list_del(&tqe->list);
+		spin_unlock_irqrestore(&wilc->txq_spinlock, flags);
+		if (tqe) {
+			wilc_wlan_txq_dec(wilc, q_num);
+			return tqe;
+		}
+	}
 
-	if (eth_hdr_ptr->h_proto != htons(ETH_P_IP))
-		goto out;
+	do {
+		if (skb_queue_empty(&wilc->txq[q_num].skb_head))
+			wilc_wlan_txq_drain_stage(wilc, q_num);
+		skb = __skb_dequeue(&wilc->txq[q_num].skb_head);
+		if (!skb)
+			return NULL;
+
+		wilc_wlan_txq_dec(wilc, q_num);
+		if (WILC_SKB_TX_CB(skb)->requeued)
+			break;
+		if (wilc_wlan_ack_dequeue(skb) &&
+		    !wilc_codel_should_drop(wilc, q_num, skb))
+			break;
+		wilc_wlan_bql_completed(skb);
+		dev_kfree_skb_any(skb);
+	} while (1);
 
-	ip_hdr_ptr = buffer + ETH_HLEN;
+	wilc_wlan_skb_to_tqe(skb, net_tqe);
+	return net_tqe;
+}
 
-	if (ip_hdr_ptr->protocol != IPPROTO_TCP)
-		goto out;
+static u32 wilc_wlan_tx_vmm_size(int type, u32 len)
+{
+	u32 vmm_sz;
 
-	ihl = ip_hdr_ptr->ihl << 2;
-	tcp_hdr_ptr = buffer + ETH_HLEN + ihl;
-	total_length = ntohs(ip_hdr_ptr->tot_len);
+	if (type == WILC_CFG_PKT)
+		vmm_sz = ETH_CONFIG_PKT_HDR_OFFSET;
+	else if (type == WILC_NET_PKT)
+		vmm_sz = ETH_ETHERNET_HDR_OFFSET;
+	else
+		vmm_sz = HOST_HDR_OFFSET;
 
-	data_offset = tcp_hdr_ptr->doff << 2;
-	if (total_length == (ihl + data_offset)) {
-		u32 seq_no, ack_no;
+	vmm_sz += len;
+	if (vmm_sz & 0x3)
+		vmm_sz = (vmm_sz + 4) & ~0x3;
 
-		seq_no = ntohl(tcp_hdr_ptr->seq);
-		ack_no = ntohl(tcp_hdr_ptr->ack_seq);
-		for (i = 0; i < f->tcp_session; i++) {
-			u32 j = f->ack_session_info[i].seq_num;
+	return vmm_sz;
+}
 
-			if (i < 2 * MAX_TCP_SESSION &&
-			    j == seq_no) {
-				update_tcp_session(vif, i, ack_no);
-				break;
-			}
-		}
-		if (i == f->tcp_session)
-			add_tcp_session(vif, 0, 0, seq_no);
+/* VMM size of the frame at the head of @q_num, 0 if the queue is empty */
+static u32 wilc_wlan_txq_head_size(struct wilc *wilc, u8 q_num)
+{
+	struct txq_entry_t *tqe;
+	struct sk_buff *skb;
+	unsigned long flags;
+	u32 size = 0;
 
-		add_tcp_pending_ack(vif, ack_no, i, tqe);
+	if (!list_empty(&wilc->txq[q_num].txq_head.list)) {
+		spin_lock_irqsave(&wilc->txq_spinlock, flags);
+		tqe = list_first_entry_or_null(&wilc->txq[q_num].txq_head.list,
+					       struct txq_entry_t, list);
+		if (tqe)
+			size = wilc_wlan_tx_vmm_size(tqe->type,
+						     tqe->buffer_size);
+		spin_unlock_irqrestore(&wilc->txq_spinlock, flags);
+		if (size)
+			return size;
+	}
+
+	if (skb_queue_empty(&wilc->txq[q_num].skb_head))
+		wilc_wlan_txq_drain_stage(wilc, q_num);
+	skb = skb_peek(&wilc->txq[q_num].skb_head);
+	if (skb)
+		size = wilc_wlan_tx_vmm_size(WILC_NET_PKT, skb->len);
+
+	return size;
+}
+
+/* put back a frame the chip had no room for, keeping its queue position */
+static void wilc_wlan_txq_requeue(struct wilc *wilc, u8 q_num,
+				  struct txq_entry_t *tqe)
+{
+	unsigned long flags;
+
+	if (tqe->type == WILC_NET_PKT) {
+		WILC_SKB_TX_CB((struct sk_buff *)tqe->priv)->requeued = true;
+		__skb_queue_head(&wilc->txq[q_num].skb_head, tqe->priv);
+	} else {
+		spin_lock_irqsave(&wilc->txq_spinlock, flags);
+		list_add(&tqe->list, &wilc->txq[q_num].txq_head.list);
+		spin_unlock_irqrestore(&wilc->txq_spinlock, flags);
 	}
+	wilc_wlan_txq_inc(wilc, q_num);
+}
 
-out:
-	spin_unlock_irqrestore(&wilc->txq_spinlock, flags);
+static void wilc_wlan_tx_complete(struct wilc *wilc, struct txq_entry_t *tqe,
+				  int status)
+{
+	if (tqe->type == WILC_NET_PKT) {
+		PRINT_INFO(tqe->vif->ndev, TX_DBG, "%s pkt Size= %d SKB= %p\n",
+			   status ? "Sent" : "Couldn't send",
+			   tqe->buffer_size, tqe->priv);
+		dev_kfree_skb_any(tqe->priv);
+		return;
+	}
+
+	tqe->status = status;
+	if (tqe->tx_complete_func)
+		tqe->tx_complete_func(tqe->priv, tqe->status);
+	kmem_cache_free(wilc->txq_cache, tqe);
 }
 
-static void wilc_wlan_txq_filter_dup_tcp_ack(struct net_device *dev)
+static void wilc_wlan_txq_add_to_tail(struct net_device *dev, u8 q_num,
+				      struct txq_entry_t *tqe)
 {
+	unsigned long flags;
 	struct wilc_vif *vif = netdev_priv(dev);
 	struct wilc *wilc = vif->wilc;
-	struct tcp_ack_filter *f = &vif->ack_filter;
-	u32 i = 0;
-	u32 dropped = 0;
-	unsigned long flags;
 
 	spin_lock_irqsave(&wilc->txq_spinlock, flags);
-	for (i = f->pending_base;
-	     i < (f->pending_base + f->pending_acks_idx); i++) {
-		u32 index;
-		u32 bigger_ack_num;
 
-		if (i >= MAX_PENDING_ACKS)
-			break;
+	list_add_tail(&tqe->list, &wilc->txq[q_num].txq_head.list);
+	spin_unlock_irqrestore(&wilc->txq_spinlock, flags);
+
+	PRINT_INFO(vif->ndev, TX_DBG, "Number of entries in TxQ = %d\n",
+		   wilc_wlan_txq_inc(wilc, q_num));
 
-		index = f->pending_acks[i].session_index;
+	PRINT_INFO(vif->ndev, TX_DBG, "Wake the txq_handling\n");
+	complete(&wilc->txq_event);
+}
 
-		if (index >= 2 * MAX_TCP_SESSION)
-			break;
+static void wilc_wlan_txq_add_skb_to_tail(struct net_device *dev, u8 q_num,
+					  struct sk_buff *skb)
+{
+	struct wilc_vif *vif = netdev_priv(dev);
+	struct wilc *wilc = vif->wilc;
 
-		bigger_ack_num = f->ack_session_info[index].bigger_ack_num;
+	llist_add(&WILC_SKB_TX_CB(skb)->node, &wilc->txq[q_num].stage);
+	PRINT_INFO(vif->ndev, TX_DBG, "Number of entries in TxQ = %d\n",
+		   wilc_wlan_txq_inc(wilc, q_num));
 
-		if (f->pending_acks[i].ack_num < bigger_ack_num) {
-			struct txq_entry_t *tqe;
+	PRINT_INFO(vif->ndev, TX_DBG, "Wake the txq_handling\n");
+	complete(&wilc->txq_event);
+}
 
-			PRINT_INFO(vif->ndev, TCP_ENH, "DROP ACK: %u\n",
-				   f->pending_acks[i].ack_num);
-			tqe = f->pending_acks[i].txqe;
-			if (tqe) {
-				wilc_wlan_txq_remove(wilc, tqe->q_num, tqe);
-				tqe->status = 1;
-				if (tqe->tx_complete_func)
-					tqe->tx_complete_func(tqe->priv,
-							      tqe->status);
-				kfree(tqe);
-				dropped++;
-			}
-		}
-	}
-	f->pending_acks_idx = 0;
-	f->tcp_session = 0;
+static void wilc_wlan_txq_add_to_head(struct wilc_vif *vif, u8 q_num,
+				     struct txq_entry_t *tqe)
+{
+	unsigned long flags;
+	struct wilc *wilc = vif->wilc;
 
-	if (f->pending_base == 0)
-		f->pending_base = MAX_TCP_SESSION;
-	else
-		f->pending_base = 0;
+	mutex_lock(&wilc->txq_add_to_head_cs);
 
-	spin_unlock_irqrestore(&wilc->txq_spinlock, flags);
+	spin_lock_irqsave(&wilc->txq_spinlock, flags);
 
-	while (dropped > 0) {
-		if (!wait_for_completion_timeout(&wilc->txq_event,
-						msecs_to_jiffies(1)))
-			PRINT_ER(vif->ndev, "completion timedout\n");
-		dropped--;
-	}
+	list_add(&tqe->list, &wilc->txq[q_num].txq_head.list);
+	spin_unlock_irqrestore(&wilc->txq_spinlock, flags);
+	PRINT_INFO(vif->ndev, TX_DBG, "Number of entries in TxQ = %d\n",
+		   wilc_wlan_txq_inc(wilc, q_num));
+	mutex_unlock(&wilc->txq_add_to_head_cs);
+	complete(&wilc->txq_event);
+	PRINT_INFO(vif->ndev, TX_DBG, "Wake up the txq_handler\n");
 }
 
-static struct net_device *get_if_handler(struct wilc *wilc, u8 *mac_header)
+/* interface of a received data frame, caller holds srcu */
+static struct wilc_vif *wilc_get_rx_vif(struct wilc *wilc, u8 *mac_header)
 {
-	u8 *bssid, *bssid1;
-	struct net_device *mon_netdev = NULL;
+	struct wilc_rx_map *map = &wilc->rx_map;
+	struct wilc_rx_map_entry *ent;
 	struct wilc_vif *vif;
+	unsigned int seq;
+	int i;
 
-	bssid = mac_header + 10;
-	bssid1 = mac_header + 4;
-	list_for_each_entry_rcu(vif, &wilc->vif_list, list) {
-		if (vif->iftype == WILC_STATION_MODE)
-			if (ether_addr_equal_unaligned(bssid, vif->bssid))
-				return vif->ndev;
-		if (vif->iftype == WILC_AP_MODE)
-			if (ether_addr_equal_unaligned(bssid1, vif->bssid))
-				return vif->ndev;
-		if (vif->iftype == WILC_MONITOR_MODE)
-			mon_netdev = vif->ndev;
-	}
+	do {
+		seq = read_seqbegin(&map->lock);
+		vif = map->monitor;
+		for (i = 0; i < map->num; i++) {
+			ent = &map->ent[i];
+			if (ether_addr_equal_unaligned(mac_header + ent->offset,
+						       ent->bssid)) {
+				vif = ent->vif;
+				break;
+			}
+		}
+	} while (read_seqretry(&map->lock, seq));
 
-	if (!mon_netdev)
-		pr_warn("%s Invalid handle\n", __func__);
-	return mon_netdev;
+	if (!vif)
+		wilc->rx_stats.demux_miss++;
+	return vif;
 }
 
 void wilc_enable_tcp_ack_filter(struct wilc_vif *vif, bool value)
@@ -315,7 +635,7 @@ static int wilc_wlan_txq_add_cfg_pkt(struct wilc_vif *vif, u8 *buffer,
 		complete(&wilc->cfg_event);
 		return 0;
 	}
-	tqe = kmalloc(sizeof(*tqe), GFP_KERNEL);
+	tqe = kmem_cache_alloc(wilc->txq_cache, GFP_KERNEL);
 	if (!tqe) {
 		complete(&wilc->cfg_event);
 		return 0;
@@ -326,7 +646,6 @@ static int wilc_wlan_txq_add_cfg_pkt(struct wilc_vif *vif, u8 *buffer,
 	tqe->tx_complete_func = NULL;
 	tqe->priv = NULL;
 	tqe->q_num = AC_VO_Q;
-	tqe->ack_idx = NOT_TCP_ACK;
 	tqe->vif = vif;
 
 	PRINT_INFO(vif->ndev, TX_DBG,
@@ -337,58 +656,12 @@ static int wilc_wlan_txq_add_cfg_pkt(struct wilc_vif *vif, u8 *buffer,
 	return 1;
 }
 
-static void ac_q_limit(struct wilc *wilc, u8 ac, u16 *q_limit)
-{
-	static u8 buffer[AC_BUFFER_SIZE];
-	static u16 end_index;
-	static bool initialized;
-	static u16 cnt[NQUEUES];
-	u8 factors[NQUEUES] = {1, 1, 1, 1};
-	static u16 sum;
-	u16 i;
-	unsigned long flags;
-
-	spin_lock_irqsave(&wilc->txq_spinlock, flags);
-	if (!initialized) {
-		for (i = 0; i < AC_BUFFER_SIZE; i++)
-			buffer[i] = i % NQUEUES;
-
-		for (i = 0; i < NQUEUES; i++) {
-			cnt[i] = AC_BUFFER_SIZE * factors[i] / NQUEUES;
-			sum += cnt[i];
-		}
-		end_index = AC_BUFFER_SIZE - 1;
-		initialized = 1;
-	}
-
-	cnt[buffer[end_index]] -= factors[buffer[end_index]];
-	cnt[ac] += factors[ac];
-	sum += (factors[ac] - factors[buffer[end_index]]);
-
-	buffer[end_index] = ac;
-	if (end_index > 0)
-		end_index--;
-	else
-		end_index = AC_BUFFER_SIZE - 1;
-
-	for (i = 0; i < NQUEUES; i++) {
-		if (!sum)
-			q_limit[i] = 1;
-		else
-			q_limit[i] = (cnt[i] * FLOW_CTRL_UP_THRESHLD / sum) + 1;
-	}
-	spin_unlock_irqrestore(&wilc->txq_spinlock, flags);
-}
-
-static inline u8 ac_classify(struct wilc *wilc, struct txq_entry_t *tqe)
+static inline u8 ac_classify(struct wilc *wilc, struct sk_buff *skb)
 {
 	u8 *eth_hdr_ptr;
-	u8 *buffer = tqe->buffer;
+	u8 *buffer = skb->data;
 	u8 ac;
 	u16 h_proto;
-	unsigned long flags;
-
-	spin_lock_irqsave(&wilc->txq_spinlock, flags);
 
 	eth_hdr_ptr = &buffer[0];
 	h_proto = ntohs(*((unsigned short *)&eth_hdr_ptr[12]));
@@ -426,29 +699,109 @@ static inline u8 ac_classify(struct wilc *wilc, struct txq_entry_t *tqe)
 		ac  = AC_BE_Q;
 	}
 
-	tqe->q_num = ac;
-	spin_unlock_irqrestore(&wilc->txq_spinlock, flags);
-
 	return ac;
 }
 
-static inline int ac_balance(u8 *count, u8 *ratio)
+static const u32 wilc_tx_default_quantum[NQUEUES] = {
+	[AC_VO_Q] = 4 * WILC_TX_QUANTUM_UNIT,
+	[AC_VI_Q] = 3 * WILC_TX_QUANTUM_UNIT,
+	[AC_BE_Q] = 2 * WILC_TX_QUANTUM_UNIT,
+	[AC_BK_Q] = WILC_TX_QUANTUM_UNIT,
+};
+
+/*
+ * Every AC keeps a reserved share of the host queue, proportional to its
+ * quantum, and may borrow beyond it while the queue as a whole is below the
+ * flow control threshold.
+ */
+static void wilc_wlan_tx_sched_update(struct wilc *wilc)
 {
-	u8 i, max_count = 0;
+	struct wilc_tx_sched *sched = &wilc->tx_sched;
+	u32 sum = 0;
+	u8 ac;
 
-	if (!count || !ratio)
-		return -1;
+	for (ac = 0; ac < NQUEUES; ac++)
+		sum += sched->quantum[ac];
+	for (ac = 0; ac < NQUEUES; ac++)
+		sched->reserve[ac] = FLOW_CTRL_UP_THRESHLD *
+				     sched->quantum[ac] / sum + 1;
+}
 
-	for (i = 0; i < NQUEUES; i++)
-		if (count[i] > max_count)
-			max_count = count[i];
+void wilc_wlan_tx_sched_init(struct wilc *wilc)
+{
+	struct wilc_tx_sched *sched = &wilc->tx_sched;
+	u8 ac;
 
-	for (i = 0; i < NQUEUES; i++)
-		ratio[i] = max_count - count[i];
+	for (ac = 0; ac < NQUEUES; ac++) {
+		sched->quantum[ac] = wilc_tx_default_quantum[ac];
+		sched->deficit[ac] = 0;
+		sched->fw_count[ac] = 0;
+	}
+	wilc_wlan_tx_sched_update(wilc);
+}
+
+int wilc_wlan_set_tx_quantum(struct wilc *wilc, u8 ac, u32 quantum)
+{
+	unsigned long flags;
+
+	if (ac >= NQUEUES || quantum < WILC_TX_QUANTUM_MIN ||
+	    quantum > WILC_TX_BUFF_SIZE)
+		return -EINVAL;
+
+	spin_lock_irqsave(&wilc->txq_spinlock, flags);
+	wilc->tx_sched.quantum[ac] = quantum;
+	wilc_wlan_tx_sched_update(wilc);
+	spin_unlock_irqrestore(&wilc->txq_spinlock, flags);
 
 	return 0;
 }
 
+static inline bool wilc_wlan_txq_admit(struct wilc *wilc, u8 q_num)
+{
+	return atomic_read(&wilc->txq[q_num].count) <
+	       wilc->tx_sched.reserve[q_num] ||
+	       atomic_read(&wilc->txq_entries) < FLOW_CTRL_UP_THRESHLD;
+}
+
+/*
+ * Netdev subqueue flow control. A subqueue is stopped once its next frame
+ * would no longer be admitted and is woken when it is back below half its
+ * reserve, or the host queue as a whole has drained.
+ */
+bool wilc_wlan_txq_stop_needed(struct wilc *wilc, u8 q_num)
+{
+	return !wilc_wlan_txq_admit(wilc, q_num);
+}
+
+bool wilc_wlan_txq_wake_allowed(struct wilc *wilc, u8 q_num)
+{
+	return atomic_read(&wilc->txq[q_num].count) <
+	       wilc->tx_sched.reserve[q_num] / 2 ||
+	       atomic_read(&wilc->txq_entries) < FLOW_CTRL_LOW_THRESHLD;
+}
+
+/*
+ * ACs with fewer frames waiting in the firmware get up to one extra quantum
+ * for this batch, so the firmware queues are refilled evenly.
+ */
+static void wilc_wlan_tx_sched_credit(struct wilc *wilc)
+{
+	struct wilc_tx_sched *sched = &wilc->tx_sched;
+	u8 ac, max_count = 0;
+
+	for (ac = 0; ac < NQUEUES; ac++)
+		if (sched->fw_count[ac] > max_count)
+			max_count = sched->fw_count[ac];
+
+	if (!max_count)
+		return;
+
+	for (ac = 0; ac < NQUEUES; ac++)
+		if (atomic_read(&wilc->txq[ac].count))
+			sched->deficit[ac] += sched->quantum[ac] *
+				(max_count - sched->fw_count[ac]) / max_count;
+}
+
 static inline void ac_pkt_count(u32 reg, u8 *pkt_count)
 {
 	pkt_count[AC_BK_Q] = (reg & 0x000000fa) >> BK_AC_COUNT_POS;
@@ -475,18 +828,33 @@ static inline void ac_acm_bit(struct wilc *wilc, u32 reg)
 	wilc->txq[AC_VO_Q].acm = (reg & 0x01000000) >> VO_AC_ACM_STAT_POS;
 }
 
-int txq_add_net_pkt(struct net_device *dev, void *priv, u8 *buffer,
-			      u32 buffer_size,
-			      void (*tx_complete_fn)(void *, int))
+/* netdev subqueue of @skb, which is its AC after any ACM downgrade */
+u16 wilc_wlan_select_queue(struct wilc *wilc, struct sk_buff *skb)
+{
+	u8 q_num, ac;
+
+	q_num = ac_classify(wilc, skb);
+	ac = q_num;
+	if (ac_change(wilc, &ac))
+		return q_num;
+
+	return ac;
+}
+
+int txq_add_net_pkt(struct net_device *dev, struct sk_buff *skb)
 {
-	struct txq_entry_t *tqe;
 	struct wilc_vif *vif = netdev_priv(dev);
+	struct wilc_skb_tx_cb *cb = WILC_SKB_TX_CB(skb);
 	struct wilc *wilc;
+	unsigned long flags;
+	bool replaced;
 	u8 q_num;
-	u16 q_limit[NQUEUES] = {0, 0, 0, 0};
+
+	BUILD_BUG_ON(sizeof(struct wilc_skb_tx_cb) > sizeof(skb->cb));
 
 	if (!vif) {
 		pr_info("%s vif is NULL\n", __func__);
+		dev_kfree_skb_any(skb);
 		return -1;
 	}
 
@@ -495,59 +863,62 @@ int txq_add_net_pkt(struct net_device *dev, void *priv, u8 *buffer,
 	if (wilc->quit) {
 		PRINT_INFO(vif->ndev, TX_DBG,
 			   "drv is quitting, return from net_pkt\n");
-		tx_complete_fn(priv, 0);
+		dev_kfree_skb_any(skb);
 		return 0;
 	}
 
 	if (!(wilc->initialized)) {
 		PRINT_INFO(vif->ndev, TX_DBG,
 			   "not_init, return from net_pkt\n");
-		tx_complete_fn(priv, 0);
+		dev_kfree_skb_any(skb);
 		return 0;
 	}
 
-	tqe = kmalloc(sizeof(*tqe), GFP_ATOMIC);
-
-	if (!tqe) {
-		PRINT_INFO(vif->ndev, TX_DBG,
-			   "malloc failed, return from net_pkt\n");
-		tx_complete_fn(priv, 0);
-		return 0;
-	}
-	tqe->type = WILC_NET_PKT;
-	tqe->buffer = buffer;
-	tqe->buffer_size = buffer_size;
-	tqe->tx_complete_func = tx_complete_fn;
-	tqe->priv = priv;
-	tqe->vif = vif;
-
-	q_num = ac_classify(wilc, tqe);
+	q_num = skb_get_queue_mapping(skb);
+	if (q_num >= NQUEUES)
+		q_num = ac_classify(wilc, skb);
 	if (ac_change(wilc, &q_num)) {
 		PRINT_INFO(vif->ndev, GENERIC_DBG,
 			   "No suitable non-ACM queue\n");
-		kfree(tqe);
+		dev_kfree_skb_any(skb);
 		return 0;
 	}
-	ac_q_limit(wilc, q_num, q_limit);
+	cb->vif = vif;
+	cb->q_num = q_num;
+	cb->ack_flow = NULL;
+	cb->ack_superseded = false;
+	cb->requeued = false;
 
-	if ((q_num == AC_VO_Q && wilc->txq[q_num].count <= q_limit[AC_VO_Q]) ||
-	    (q_num == AC_VI_Q && wilc->txq[q_num].count <= q_limit[AC_VI_Q]) ||
-	    (q_num == AC_BE_Q && wilc->txq[q_num].count <= q_limit[AC_BE_Q]) ||
-	    (q_num == AC_BK_Q && wilc->txq[q_num].count <= q_limit[AC_BK_Q])) {
+	if (wilc_wlan_txq_admit(wilc, q_num)) {
 		PRINT_INFO(vif->ndev, TX_DBG,
-			   "Adding mgmt packet at the Queue tail\n");
-		tqe->ack_idx = NOT_TCP_ACK;
-		if (vif->ack_filter.enabled)
-			tcp_process(dev, tqe);
-		wilc_wlan_txq_add_to_tail(dev, q_num, tqe);
+			   "Adding net packet at the Queue tail\n");
+		cb->enqueue_ns = ktime_to_ns(ktime_get());
+		if (!vif->ack_filter.enabled) {
+			wilc_wlan_bql_sent(skb);
+			wilc_wlan_txq_add_skb_to_tail(dev, q_num, skb);
+			return atomic_read(&wilc->txq_entries);
+		}
+
+		/*
+		 * Once tcp_process() made this the newest ACK of its flow it
+		 * has to be on the stage before the filter looks again.
+		 */
+		spin_lock_irqsave(&vif->ack_filter.lock, flags);
+		replaced = tcp_process(vif, skb);
+		if (!replaced) {
+			wilc_wlan_bql_sent(skb);
+			wilc_wlan_txq_add_skb_to_tail(dev, q_num, skb);
+		}
+		spin_unlock_irqrestore(&vif->ack_filter.lock, flags);
+		if (replaced) {
+			dev_kfree_skb_any(skb);
+			return 0;
+		}
 	} else {
-		tqe->status = 0;
-		if (tqe->tx_complete_func)
-			tqe->tx_complete_func(tqe->priv, tqe->status);
-		kfree(tqe);
+		dev_kfree_skb_any(skb);
 	}
 
-	return wilc->txq_entries;
+	return atomic_read(&wilc->txq_entries);
 }
 
 int txq_add_mgmt_pkt(struct net_device *dev, void *priv, u8 *buffer,
@@ -571,7 +942,7 @@ int txq_add_mgmt_pkt(struct net_device *dev, void *priv, u8 *buffer,
 		tx_complete_fn(priv, 0);
 		return 0;
 	}
-	tqe = kmalloc(sizeof(*tqe), GFP_ATOMIC);
+	tqe = kmem_cache_alloc(wilc->txq_cache, GFP_ATOMIC);
 
 	if (!tqe) {
 		PRINT_INFO(vif->ndev, TX_DBG, "Queue malloc failed\n");
@@ -584,7 +955,6 @@ int txq_add_mgmt_pkt(struct net_device *dev, void *priv, u8 *buffer,
 	tqe->tx_complete_func = tx_complete_fn;
 	tqe->priv = priv;
 	tqe->q_num = AC_BE_Q;
-	tqe->ack_idx = NOT_TCP_ACK;
 	tqe->vif = vif;
 
 	PRINT_INFO(vif->ndev, TX_DBG, "Adding Mgmt packet to Queue tail\n");
@@ -592,62 +962,6 @@ int txq_add_mgmt_pkt(struct net_device *dev, void *priv, u8 *buffer,
 	return 1;
 }
 
-static struct txq_entry_t *txq_get_first(struct wilc *wilc, u8 q_num)
-{
-	struct txq_entry_t *tqe = NULL;
-	unsigned long flags;
-
-	spin_lock_irqsave(&wilc->txq_spinlock, flags);
-
-	if (!list_empty(&wilc->txq[q_num].txq_head.list))
-		tqe = list_first_entry(&wilc->txq[q_num].txq_head.list,
-				       struct txq_entry_t, list);
-
-	spin_unlock_irqrestore(&wilc->txq_spinlock, flags);
-
-	return tqe;
-}
-
-static struct txq_entry_t *txq_get_next(struct wilc *wilc,
-					struct txq_entry_t *tqe, u8 q_num)
-{
-	unsigned long flags;
-
-	spin_lock_irqsave(&wilc->txq_spinlock, flags);
-
-	if (!list_is_last(&tqe->list, &wilc->txq[q_num].txq_head.list))
-		tqe = list_next_entry(tqe, list);
-	else
-		tqe = NULL;
-	spin_unlock_irqrestore(&wilc->txq_spinlock, flags);
-
-	return tqe;
-}
-
-static void rxq_add(struct wilc *wilc, struct rxq_entry_t *rqe)
-{
-	if (wilc->quit)
-		return;
-
-	mutex_lock(&wilc->rxq_cs);
-	list_add_tail(&rqe->list, &wilc->rxq_head.list);
-	mutex_unlock(&wilc->rxq_cs);
-}
-
-static struct rxq_entry_t *rxq_remove(struct wilc *wilc)
-{
-	struct rxq_entry_t *rqe = NULL;
-
-	mutex_lock(&wilc->rxq_cs);
-	if (!list_empty(&wilc->rxq_head.list)) {
-		rqe = list_first_entry(&wilc->rxq_head.list, struct rxq_entry_t,
-				       list);
-		list_del(&rqe->list);
-	}
-	mutex_unlock(&wilc->rxq_cs);
-	return rqe;
-}
-
 static int chip_allow_sleep_wilc1000(struct wilc *wilc, int source)
 {
 	u32 reg = 0;
@@ -686,22 +1000,22 @@ static int chip_allow_sleep_wilc1000(struct wilc *wilc, int source)
 		pr_warn("FW not responding\n");
 
 	/* Clear bit 1 */
-	ret = hif_func->hif_read_reg(wilc, wakeup_reg, &reg);
+	ret = wilc_reg_read_cached(wilc, wakeup_reg, &reg);
 	if (!ret)
 		return -EIO;
 	if (reg & wakeup_bit) {
 		reg &= ~wakeup_bit;
-		ret = hif_func->hif_write_reg(wilc, wakeup_reg, reg);
+		ret = wilc_reg_write_cached(wilc, wakeup_reg, reg);
 		if (!ret)
 			return -EIO;
 	}
 
-	ret = hif_func->hif_read_reg(wilc, from_host_to_fw_reg, &reg);
+	ret = wilc_reg_read_cached(wilc, from_host_to_fw_reg, &reg);
 	if (!ret)
 		return -EIO;
 	if (reg & from_host_to_fw_bit) {
 		reg &= ~from_host_to_fw_bit;
-		ret = hif_func->hif_write_reg(wilc, from_host_to_fw_reg, reg);
+		ret = wilc_reg_write_cached(wilc, from_host_to_fw_reg, reg);
 		if (!ret)
 			return -EIO;
 	}
@@ -713,21 +1027,20 @@ static int chip_allow_sleep_wilc3000(struct wilc *wilc, int source)
 {
 	u32 reg = 0;
 	int ret;
-	const struct wilc_hif_func *hif_func = wilc->hif_func;
 
 	if (wilc->io_type == WILC_HIF_SDIO ||
 		wilc->io_type == WILC_HIF_SDIO_GPIO_IRQ) {
-		ret = hif_func->hif_read_reg(wilc, 0xf0, &reg);
+		ret = wilc_reg_read_cached(wilc, 0xf0, &reg);
 		if (!ret)
 			return -EIO;
-		ret = hif_func->hif_write_reg(wilc, 0xf0, reg & ~BIT(0));
+		ret = wilc_reg_write_cached(wilc, 0xf0, reg & ~BIT(0));
 		if (!ret)
 			return -EIO;
 	} else {
-		ret = hif_func->hif_read_reg(wilc, 0x1, &reg);
+		ret = wilc_reg_read_cached(wilc, 0x1, &reg);
 		if (!ret)
 			return -EIO;
-		ret = hif_func->hif_write_reg(wilc, 0x1, reg & ~BIT(1));
+		ret = wilc_reg_write_cached(wilc, 0x1, reg & ~BIT(1));
 		if (!ret)
 			return -EIO;
 	}
@@ -760,6 +1073,7 @@ void chip_wakeup_wilc1000(struct wilc *wilc, int source)
 	u32 to_host_from_fw_reg, to_host_from_fw_bit;
 	u32 from_host_to_fw_reg, from_host_to_fw_bit;
 	const struct wilc_hif_func *hif_func = wilc->hif_func;
+	struct wilc_reg_op ops[3];
 
 	if (wilc->io_type == WILC_HIF_SDIO ||
 		wilc->io_type == WILC_HIF_SDIO_GPIO_IRQ) {
@@ -783,28 +1097,21 @@ void chip_wakeup_wilc1000(struct wilc *wilc, int source)
 	}
 
 
-	/*USE bit 0 to indicate host wakeup*/
-	ret = hif_func->hif_write_reg(wilc, from_host_to_fw_reg,
-				      from_host_to_fw_bit);
-	if (!ret)
-		goto _fail_;
-
-	/* Set bit 1 */
-	ret = hif_func->hif_write_reg(wilc, wakeup_reg,
-				      wakeup_bit);
+	/*
+	 * USE bit 0 to indicate host wakeup, set bit 1 and take the first
+	 * look at the clock status in one go
+	 */
+	ops[0] = (struct wilc_reg_op){ WILC_REG_WRITE, from_host_to_fw_reg,
+				       from_host_to_fw_bit };
+	ops[1] = (struct wilc_reg_op){ WILC_REG_WRITE, wakeup_reg,
+				       wakeup_bit };
+	ops[2] = (struct wilc_reg_op){ WILC_REG_READ, clk_status_reg };
+	ret = wilc_reg_batch(wilc, ops, 3);
 	if (!ret)
 		goto _fail_;
+	clk_status_val = ops[2].val;
 
-	do {
-		ret = hif_func->hif_read_reg(wilc, clk_status_reg,
-					     &clk_status_val);
-		if (!ret) {
-			pr_err("Bus error (5).%d %x\n", ret, clk_status_val);
-			goto _fail_;
-		}
-		if (clk_status_val & clk_status_bit)
-			break;
-
+	while (!(clk_status_val & clk_status_bit)) {
 		//nm_bsp_sleep(2);
 		trials++;
 		if (trials > WAKUP_TRAILS_TIMEOUT) {
@@ -812,18 +1119,26 @@ void chip_wakeup_wilc1000(struct wilc *wilc, int source)
 			ret = -1;
 			goto _fail_;
 		}
-	} while (1);
+
+		ret = hif_func->hif_read_reg(wilc, clk_status_reg,
+					     &clk_status_val);
+		if (!ret) {
+			pr_err("Bus error (5).%d %x\n", ret, clk_status_val);
+			goto _fail_;
+		}
+	}
 
 	if (wilc_get_chipid(wilc, false) < 0x1002b0) {
-		uint32_t val32;
 		/* Enable PALDO back right after wakeup */
-		hif_func->hif_read_reg(wilc, 0x1e1c, &val32);
-		val32 |= BIT(6);
-		hif_func->hif_write_reg(wilc, 0x1e1c, val32);
-
-		hif_func->hif_read_reg(wilc, 0x1e9c, &val32);
-		val32 |= BIT(6);
-		hif_func->hif_write_reg(wilc, 0x1e9c, val32);
+		ops[0] = (struct wilc_reg_op){ WILC_REG_READ, 0x1e1c };
+		ops[1] = (struct wilc_reg_op){ WILC_REG_READ, 0x1e9c };
+		if (wilc_reg_batch(wilc, ops, 2)) {
+			ops[0].type = WILC_REG_WRITE;
+			ops[0].val |= BIT(6);
+			ops[1].type = WILC_REG_WRITE;
+			ops[1].val |= BIT(6);
+			wilc_reg_batch(wilc, ops, 2);
+		}
 	}
 	/*workaround sometimes spi fail to read clock regs after reading
 	 * writing clockless registers
@@ -841,6 +1156,7 @@ void chip_wakeup_wilc3000(struct wilc *wilc, int source)
 	u32 clk_status_reg, clk_status_bit;
 	int wake_seq_trials = 5;
 	const struct wilc_hif_func *hif_func = wilc->hif_func;
+	struct wilc_reg_op ops[2];
 
 	if (wilc->io_type == WILC_HIF_SDIO ||
 		wilc->io_type == WILC_HIF_SDIO_GPIO_IRQ) {
@@ -855,13 +1171,14 @@ void chip_wakeup_wilc3000(struct wilc *wilc, int source)
 		clk_status_bit = BIT(2);
 	}
 
-	hif_func->hif_read_reg(wilc, wakeup_reg, &wakeup_reg_val);
+	wilc_reg_read_cached(wilc, wakeup_reg, &wakeup_reg_val);
 	do {
-		hif_func->hif_write_reg(wilc, wakeup_reg, wakeup_reg_val |
-							  wakeup_bit);
-		/* Check the clock status */
-		hif_func->hif_read_reg(wilc, clk_status_reg,
-				       &clk_status_reg_val);
+		/* Set the wakeup bit and check the clock status */
+		ops[0] = (struct wilc_reg_op){ WILC_REG_WRITE, wakeup_reg,
+					       wakeup_reg_val | wakeup_bit };
+		ops[1] = (struct wilc_reg_op){ WILC_REG_READ, clk_status_reg };
+		wilc_reg_batch(wilc, ops, 2);
+		clk_status_reg_val = ops[1].val;
 
 		/*
 		 * in case of clocks off, wait 1ms, and check it again.
@@ -885,8 +1202,8 @@ void chip_wakeup_wilc3000(struct wilc *wilc, int source)
 		 * edge on the next loop
 		 */
 		if ((clk_status_reg_val & clk_status_bit) == 0)
-			hif_func->hif_write_reg(wilc, wakeup_reg,
-						wakeup_reg_val & (~wakeup_bit));
+			wilc_reg_write_cached(wilc, wakeup_reg,
+					      wakeup_reg_val & (~wakeup_bit));
 	} while (((clk_status_reg_val & clk_status_bit) == 0)
 		 && (wake_seq_trials-- > 0));
 	if (!wake_seq_trials)
@@ -922,88 +1239,291 @@ void host_sleep_notify(struct wilc *wilc, int source)
 	release_bus(wilc, WILC_BUS_RELEASE_ONLY, source);
 }
 
-static u8 ac_fw_count[NQUEUES] = {0, 0, 0, 0};
+static u32 wilc_wlan_tx_fill_hdr(struct txq_entry_t *tqe, u32 vmm_sz, u8 *hdr)
+{
+	u32 header, buffer_offset;
+
+	header = (tqe->type << 31) |
+		 (tqe->buffer_size << 15) |
+		 vmm_sz;
+	if (tqe->type == WILC_MGMT_PKT)
+		header |= BIT(30);
+	else
+		header &= ~BIT(30);
+
+	cpu_to_le32s(&header);
+	memcpy(hdr, &header, 4);
+	if (tqe->type == WILC_CFG_PKT) {
+		buffer_offset = ETH_CONFIG_PKT_HDR_OFFSET;
+	} else if (tqe->type == WILC_NET_PKT) {
+		char *bssid = tqe->vif->bssid;
+		int prio = tqe->q_num;
+
+		buffer_offset = ETH_ETHERNET_HDR_OFFSET;
+		memcpy(&hdr[4], &prio, sizeof(prio));
+		memcpy(&hdr[8], bssid, 6);
+	} else {
+		buffer_offset = HOST_HDR_OFFSET;
+	}
+
+	return buffer_offset;
+}
+
+static void wilc_wlan_tx_slot_complete(struct wilc *wilc,
+				       struct wilc_tx_slot *slot, int status)
+{
+	int i;
+
+	for (i = 0; i < slot->npending; i++)
+		wilc_wlan_tx_complete(wilc, slot->batch.tqe[i], status);
+	slot->npending = 0;
+}
+
+/* account bus time spent on TX, and the gaps left while frames wait */
+static void wilc_wlan_tx_bus_busy(struct wilc *wilc, ktime_t start)
+{
+	ktime_t now = ktime_get();
+
+	wilc->tx_stats.bus_busy_ns += ktime_to_ns(ktime_sub(now, start));
+	if (atomic_read(&wilc->txq_entries))
+		wilc->tx_bus_idle_since = now;
+	else
+		wilc->tx_bus_idle_since = ktime_set(0, 0);
+}
+
+static void wilc_wlan_tx_bus_idle(struct wilc *wilc, ktime_t now)
+{
+	if (ktime_to_ns(wilc->tx_bus_idle_since))
+		wilc->tx_stats.bus_idle_ns +=
+			ktime_to_ns(ktime_sub(now, wilc->tx_bus_idle_since));
+	wilc->tx_bus_idle_since = ktime_set(0, 0);
+}
+
+static void wilc_wlan_tx_slot_done(void *priv, int status)
+{
+	struct wilc_tx_slot *slot = priv;
+
+	slot->status = status;
+	slot->finishing = true;
+	queue_work(slot->wilc->tx_workqueue, &slot->work);
+}
+
+/*
+ * Data phase of a TX batch. It runs on tx_workqueue so the TX thread can
+ * dequeue and pack the next batch into the other slot meanwhile.
+ *
+ * If the bus queues the data asynchronously, the bus is released as soon
+ * as the block is queued and the VMM request of the next batch or an RX
+ * interrupt can line up behind it. The bus completion queues this work
+ * again to let the chip sleep and complete the frames.
+ */
+void wilc_wlan_tx_slot_work(struct work_struct *work)
+{
+	struct wilc_tx_slot *slot = container_of(work, struct wilc_tx_slot,
+						 work);
+	struct wilc *wilc = slot->wilc;
+	const struct wilc_hif_func *func = wilc->hif_func;
+	struct wilc_tx_seg *seg = slot->sg.seg;
+	u32 nseg = slot->nseg;
+	int ret;
+
+	if (slot->finishing) {
+		slot->finishing = false;
+		ret = slot->status;
+		if (!ret)
+			pr_err("%s: fail block tx ext\n", __func__);
+		acquire_bus(wilc, WILC_BUS_ACQUIRE_ONLY, DEV_WIFI);
+		goto out;
+	}
+
+	reinit_completion(&slot->done);
+	acquire_bus(wilc, WILC_BUS_ACQUIRE_AND_WAKEUP, DEV_WIFI);
+	slot->start = ktime_get();
+	ret = func->hif_clear_int_ext(wilc, ENABLE_TX_VMM);
+	if (!ret) {
+		pr_err("%s: fail start tx VMM\n", __func__);
+		goto out;
+	}
+
+	if (func->hif_block_tx_ext_async) {
+		/* a copied batch goes out as a single segment */
+		if (!nseg) {
+			seg[0].buf = slot->buffer;
+			seg[0].len = slot->len;
+			nseg = 1;
+		}
+		ret = func->hif_block_tx_ext_async(wilc, 0, seg, nseg,
+						   slot->len,
+						   wilc_wlan_tx_slot_done,
+						   slot);
+		if (ret) {
+			release_bus(wilc, WILC_BUS_RELEASE_ONLY, DEV_WIFI);
+			return;
+		}
+	} else if (nseg) {
+		ret = func->hif_block_tx_ext_sg(wilc, 0, seg, nseg,
+						slot->len);
+	} else {
+		ret = func->hif_block_tx_ext(wilc, 0, slot->buffer, slot->len);
+	}
+	if (!ret)
+		pr_err("%s: fail block tx ext\n", __func__);
+
+out:
+	wilc_wlan_tx_bus_busy(wilc, slot->start);
+	release_bus(wilc, WILC_BUS_RELEASE_ALLOW_SLEEP, DEV_WIFI);
+	wilc_wlan_tx_slot_complete(wilc, slot, ret > 0);
+	complete_all(&slot->done);
+}
+
+void wilc_wlan_tx_flush(struct wilc *wilc)
+{
+	int i;
+
+	for (i = 0; i < WILC_TX_SLOTS; i++) {
+		flush_work(&wilc->tx_slot[i].work);
+		wait_for_completion(&wilc->tx_slot[i].done);
+	}
+}
+
+/*
+ * Write the headers and payloads of the whole batch before the chip is
+ * asked for VMM space. If it grants fewer entries, only the packed prefix
+ * is sent, which end[] and seg_end[] describe.
+ */
+static void wilc_wlan_tx_pack(struct wilc_tx_slot *slot, u32 *vmm_table,
+			      int count, bool use_sg)
+{
+	struct txq_entry_t *tqe;
+	u32 buffer_offset, pad, vmm_sz;
+	u32 offset = 0, nseg = 0;
+	u8 *hdr;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		tqe = slot->batch.tqe[i];
+		vmm_sz = (le32_to_cpu(vmm_table[i]) & 0x3ff) * 4;
+
+		if (use_sg) {
+			hdr = &slot->sg.hdr_buf[i * WILC_TX_SG_HDR_SLOT];
+			memset(hdr, 0, WILC_TX_SG_HDR_SLOT);
+		} else {
+			hdr = &slot->buffer[offset];
+		}
+		buffer_offset = wilc_wlan_tx_fill_hdr(tqe, vmm_sz, hdr);
+
+		if (use_sg) {
+			slot->sg.seg[nseg].buf = hdr;
+			slot->sg.seg[nseg++].len = buffer_offset;
+			slot->sg.seg[nseg].buf = tqe->buffer;
+			slot->sg.seg[nseg++].len = tqe->buffer_size;
+			pad = vmm_sz - buffer_offset - tqe->buffer_size;
+			if (pad) {
+				slot->sg.seg[nseg].buf =
+				&slot->sg.hdr_buf[WILC_TX_SG_PAD_OFFSET];
+				slot->sg.seg[nseg++].len = pad;
+			}
+		} else {
+			memcpy(&slot->buffer[offset + buffer_offset],
+			       tqe->buffer, tqe->buffer_size);
+		}
+		offset += vmm_sz;
+		slot->end[i] = offset;
+		slot->seg_end[i] = nseg;
+	}
+}
+
 int wilc_wlan_handle_txq(struct wilc *wilc, u32 *txq_count)
 {
 	int i, entries = 0;
-	u8 k, ac;
+	u8 ac;
 	u32 sum;
 	u32 reg;
-	u8 ac_desired_ratio[NQUEUES] = {0, 0, 0, 0};
-	u8 ac_preserve_ratio[NQUEUES] = {1, 1, 1, 1};
-	u8 *num_pkts_to_add;
-	u8 vmm_entries_ac[WILC_VMM_TBL_SIZE];
-	u8 *txb;
-	u32 offset = 0;
+	struct wilc_reg_op ops[4];
+	struct wilc_tx_sched *sched = &wilc->tx_sched;
 	bool max_size_over = 0, ac_exist = 0;
 	int vmm_sz = 0;
-	struct txq_entry_t *tqe_q[NQUEUES];
+	struct wilc_tx_slot *slot;
+	struct txq_entry_t *tqe;
 	int ret = 0;
 	int counter;
 	int timeout;
 	u32 vmm_table[WILC_VMM_TBL_SIZE];
 	u8 ac_pkt_num_to_chip[NQUEUES] = {0, 0, 0, 0};
 	struct wilc_vif *vif;
-	const struct wilc_hif_func *func;
-	int srcu_idx;
+	const struct wilc_hif_func *func = wilc->hif_func;
+	bool use_sg = !!func->hif_block_tx_ext_sg;
+	int nbatch = 0;
+	ktime_t start;
 
-	txb = wilc->tx_buffer;
-	if (!wilc->txq_entries) {
+	if (!atomic_read(&wilc->txq_entries)) {
 		*txq_count = 0;
 		return 0;
 	}
 
 	if (wilc->quit)
 		goto out;
-	if (ac_balance(ac_fw_count, ac_desired_ratio))
-		return -1;
 
 	mutex_lock(&wilc->txq_add_to_head_cs);
 
-	srcu_idx = srcu_read_lock(&wilc->srcu);
-	list_for_each_entry_rcu(vif, &wilc->vif_list, list)
-		wilc_wlan_txq_filter_dup_tcp_ack(vif->ndev);
-	srcu_read_unlock(&wilc->srcu, srcu_idx);
-
-	for (ac = 0; ac < NQUEUES; ac++)
-		tqe_q[ac] = txq_get_first(wilc, ac);
+	/*
+	 * The slot packed here was last sent two batches ago. Its data went
+	 * out before the previous VMM request, but with an async bus the
+	 * frames may not be completed yet.
+	 */
+	slot = &wilc->tx_slot[wilc->tx_slot_idx];
+	wait_for_completion(&slot->done);
 
+	/*
+	 * Deficit round robin over the ACs, VO first. An AC sends while its
+	 * deficit covers the head frame and carries the rest to the next round.
+	 */
+	wilc_wlan_tx_sched_credit(wilc);
 	i = 0;
 	sum = 0;
 	max_size_over = 0;
-	num_pkts_to_add = ac_desired_ratio;
 	do {
 		ac_exist = 0;
 		for (ac = 0; (ac < NQUEUES) && (!max_size_over); ac++) {
-			if (!tqe_q[ac])
+			if (!atomic_read(&wilc->txq[ac].count)) {
+				sched->deficit[ac] = 0;
 				continue;
-			vif = tqe_q[ac]->vif;
-			ac_exist = 1;
-			for (k = 0; (k < num_pkts_to_add[ac]) &&
-				    (!max_size_over) && tqe_q[ac]; k++) {
+			}
+			sched->deficit[ac] += sched->quantum[ac];
+			while (!max_size_over) {
 				if (i >= (WILC_VMM_TBL_SIZE - 1)) {
 					max_size_over = 1;
 					break;
 				}
 
-				if (tqe_q[ac]->type == WILC_CFG_PKT)
-					vmm_sz = ETH_CONFIG_PKT_HDR_OFFSET;
-				else if (tqe_q[ac]->type == WILC_NET_PKT)
-					vmm_sz = ETH_ETHERNET_HDR_OFFSET;
-				else
-					vmm_sz = HOST_HDR_OFFSET;
-
-				vmm_sz += tqe_q[ac]->buffer_size;
-				PRINT_INFO(vif->ndev, TX_DBG,
-					   "VMM Size before alignment = %d\n",
-					   vmm_sz);
-				if (vmm_sz & 0x3)
-					vmm_sz = (vmm_sz + 4) & ~0x3;
-
+				vmm_sz = wilc_wlan_txq_head_size(wilc, ac);
+				if (!vmm_sz) {
+					sched->deficit[ac] = 0;
+					break;
+				}
+				ac_exist = 1;
+				if (vmm_sz > sched->deficit[ac])
+					break;
 				if ((sum + vmm_sz) > WILC_TX_BUFF_SIZE) {
 					max_size_over = 1;
 					break;
 				}
+
+				tqe = wilc_wlan_txq_remove_from_head(wilc, ac,
+							&slot->batch.net_tqe[i]);
+				if (!tqe)
+					break;
+				/* superseded ACKs may have been dropped on the way */
+				vmm_sz = wilc_wlan_tx_vmm_size(tqe->type,
+							       tqe->buffer_size);
+				if (vmm_sz > sched->deficit[ac] ||
+				    (sum + vmm_sz) > WILC_TX_BUFF_SIZE) {
+					wilc_wlan_txq_requeue(wilc, ac, tqe);
+					break;
+				}
+				vif = tqe->vif;
+				sched->deficit[ac] -= vmm_sz;
+
 				PRINT_INFO(vif->ndev, TX_DBG,
 					   "VMM Size AFTER alignment = %d\n",
 					   vmm_sz);
@@ -1011,32 +1531,38 @@ int wilc_wlan_handle_txq(struct wilc *wilc, u32 *txq_count)
 				PRINT_INFO(vif->ndev, TX_DBG,
 					   "VMMTable entry size = %d\n",
 					   vmm_table[i]);
-				if (tqe_q[ac]->type == WILC_CFG_PKT) {
+				if (tqe->type == WILC_CFG_PKT) {
 					vmm_table[i] |= BIT(10);
 					PRINT_INFO(vif->ndev, TX_DBG,
 						   "VMMTable entry changed for CFG packet = %d\n",
 						   vmm_table[i]);
 				}
 				cpu_to_le32s(&vmm_table[i]);
-				vmm_entries_ac[i] = ac;
+				slot->batch.tqe[i] = tqe;
+				slot->batch.ac[i] = ac;
 
 				i++;
 				sum += vmm_sz;
 				PRINT_INFO(vif->ndev, TX_DBG, "sum = %d\n",
 					   sum);
-				tqe_q[ac] = txq_get_next(wilc, tqe_q[ac], ac);
 			}
 		}
-		num_pkts_to_add = ac_preserve_ratio;
 	} while (!max_size_over && ac_exist);
 
+	nbatch = i;
 	if (i == 0)
 		goto out;
 	vmm_table[i] = 0x0;
 
+	wilc_wlan_tx_pack(slot, vmm_table, nbatch, use_sg);
+
+	/* the previous batch has to be on the chip before new VMM entries */
+	flush_work(&wilc->tx_slot[!wilc->tx_slot_idx].work);
+
 	acquire_bus(wilc, WILC_BUS_ACQUIRE_AND_WAKEUP, DEV_WIFI);
+	start = ktime_get();
+	wilc_wlan_tx_bus_idle(wilc, start);
 	counter = 0;
-	func = wilc->hif_func;
 	do {
 		ret = func->hif_read_reg(wilc, WILC_HOST_TX_CTRL, &reg);
 		if (!ret) {
@@ -1045,7 +1571,7 @@ int wilc_wlan_handle_txq(struct wilc *wilc, u32 *txq_count)
 			break;
 		}
 		if ((reg & 0x1) == 0) {
-			ac_pkt_count(reg, ac_fw_count);
+			ac_pkt_count(reg, sched->fw_count);
 			ac_acm_bit(wilc, reg);
 			break;
 		}
@@ -1076,69 +1602,60 @@ int wilc_wlan_handle_txq(struct wilc *wilc, u32 *txq_count)
 		}
 
 		if (wilc->chip == WILC_1000) {
-			ret = wilc->hif_func->hif_write_reg(wilc,
-							    WILC_HOST_VMM_CTL,
-							    0x2);
+			ops[0] = (struct wilc_reg_op){ WILC_REG_WRITE,
+						       WILC_HOST_VMM_CTL, 0x2 };
+			ops[1] = (struct wilc_reg_op){ WILC_REG_READ,
+						       WILC_HOST_VMM_CTL };
+			ret = wilc_reg_batch(wilc, ops, 2);
 			if (!ret) {
 				PRINT_ER(vif->ndev,
 					  "fail write reg host_vmm_ctl..\n");
 				break;
 			}
 
-			do {
+			reg = ops[1].val;
+			while (!((reg >> 2) & 0x1) && --timeout) {
 				ret = func->hif_read_reg(wilc,
 						      WILC_HOST_VMM_CTL,
 						      &reg);
 				if (!ret)
 					break;
-				if ((reg >> 2) & 0x1) {
-					entries = ((reg >> 3) & 0x3f);
-					break;
-				}
-			} while (--timeout);
-		} else {
-			ret = func->hif_write_reg(wilc,
-					      WILC_HOST_VMM_CTL,
-					      0);
-			if (!ret) {
-				PRINT_ER(vif->ndev,
-					  "fail write reg host_vmm_ctl..\n");
-				break;
 			}
+			if ((reg >> 2) & 0x1)
+				entries = ((reg >> 3) & 0x3f);
+		} else {
+			ops[0] = (struct wilc_reg_op){ WILC_REG_WRITE,
+						       WILC_HOST_VMM_CTL, 0 };
 			/* interrupt firmware */
-			ret = func->hif_write_reg(wilc,
-					      WILC_INTERRUPT_CORTUS_0,
-					      1);
+			ops[1] = (struct wilc_reg_op){ WILC_REG_WRITE,
+						       WILC_INTERRUPT_CORTUS_0,
+						       1 };
+			/*
+			 * the entries in host_vmm_ctl are valid once the
+			 * firmware has taken the interrupt
+			 */
+			ops[2] = (struct wilc_reg_op){ WILC_REG_READ,
+						       WILC_INTERRUPT_CORTUS_0 };
+			ops[3] = (struct wilc_reg_op){ WILC_REG_READ,
+						       WILC_HOST_VMM_CTL };
+			ret = wilc_reg_batch(wilc, ops, 4);
 			if (!ret) {
 				PRINT_ER(vif->ndev,
-					  "fail write reg WILC_INTERRUPT_CORTUS_0..\n");
+					  "fail write reg host_vmm_ctl..\n");
 				break;
 			}
 
-			do {
-				ret = func->hif_read_reg(wilc,
-						      WILC_INTERRUPT_CORTUS_0,
-						      &reg);
+			while (ops[2].val && --timeout) {
+				ret = wilc_reg_batch(wilc, &ops[2], 2);
 				if (!ret) {
 					PRINT_ER(vif->ndev,
 						  "fail read reg WILC_INTERRUPT_CORTUS_0..\n");
 					break;
 				}
-				if (reg == 0) {
-					// Get the entries
-
-					ret = func->hif_read_reg(wilc,
-							      WILC_HOST_VMM_CTL,
-							      &reg);
-					if (!ret) {
-						PRINT_ER(vif->ndev,
-							  "fail read reg host_vmm_ctl..\n");
-						break;
-					}
-					entries = ((reg >> 3) & 0x3f);
-					break;
-				}
-			} while (--timeout);
+			}
+			reg = ops[3].val;
+			if (!ops[2].val)
+				entries = ((reg >> 3) & 0x3f);
 		}
 		if (timeout <= 0) {
 			ret = func->hif_write_reg(wilc, WILC_HOST_VMM_CTL, 0x0);
@@ -1170,99 +1687,55 @@ int wilc_wlan_handle_txq(struct wilc *wilc, u32 *txq_count)
 		break;
 	} while (1);
 
+out_release_bus:
 	if (!ret)
-		goto out_release_bus;
-
-	if (entries == 0) {
-		ret = -ENOBUFS;
-		goto out_release_bus;
-	}
-
+		entries = 0;
+	if (entries > nbatch)
+		entries = nbatch;
+	wilc_wlan_tx_bus_busy(wilc, start);
 	release_bus(wilc, WILC_BUS_RELEASE_ALLOW_SLEEP, DEV_WIFI);
-	schedule();
-	offset = 0;
-	i = 0;
-	do {
-		struct txq_entry_t *tqe;
-		u32 header, buffer_offset;
 
-		tqe = wilc_wlan_txq_remove_from_head(wilc, vmm_entries_ac[i]);
-		ac_pkt_num_to_chip[vmm_entries_ac[i]]++;
-		if (!tqe)
-			break;
+	for (i = nbatch - 1; i >= entries; i--)
+		wilc_wlan_txq_requeue(wilc, slot->batch.ac[i],
+				      slot->batch.tqe[i]);
 
-		if (vmm_table[i] == 0)
-			break;
+	if (!ret)
+		goto out;
 
-		vif = tqe->vif;
-		le32_to_cpus(&vmm_table[i]);
-		vmm_sz = (vmm_table[i] & 0x3ff);
-		vmm_sz *= 4;
-		header = (tqe->type << 31) |
-			 (tqe->buffer_size << 15) |
-			 vmm_sz;
-		if (tqe->type == WILC_MGMT_PKT)
-			header |= BIT(30);
-		else
-			header &= ~BIT(30);
-
-		cpu_to_le32s(&header);
-		memcpy(&txb[offset], &header, 4);
-		if (tqe->type == WILC_CFG_PKT) {
-			buffer_offset = ETH_CONFIG_PKT_HDR_OFFSET;
-		} else if (tqe->type == WILC_NET_PKT) {
-			char *bssid = tqe->vif->bssid;
-			int prio = tqe->q_num;
-
-			buffer_offset = ETH_ETHERNET_HDR_OFFSET;
-			memcpy(&txb[offset + 4], &prio, sizeof(prio));
-			memcpy(&txb[offset + 8], bssid, 6);
-		} else {
-			buffer_offset = HOST_HDR_OFFSET;
-		}
+	if (entries == 0) {
+		ret = -ENOBUFS;
+		goto out;
+	}
 
-		memcpy(&txb[offset + buffer_offset],
-		       tqe->buffer, tqe->buffer_size);
-		offset += vmm_sz;
-		i++;
-		tqe->status = 1;
-		if (tqe->tx_complete_func)
-			tqe->tx_complete_func(tqe->priv,
-					      tqe->status);
-		if (tqe->ack_idx != NOT_TCP_ACK &&
-		    tqe->ack_idx < MAX_PENDING_ACKS)
-			vif->ack_filter.pending_acks[tqe->ack_idx].txqe = NULL;
-		kfree(tqe);
-	} while (--entries);
+	for (i = 0; i < entries; i++)
+		ac_pkt_num_to_chip[slot->batch.ac[i]]++;
 	for (i = 0; i < NQUEUES; i++)
-		ac_fw_count[i] += ac_pkt_num_to_chip[i];
-
-	acquire_bus(wilc, WILC_BUS_ACQUIRE_AND_WAKEUP, DEV_WIFI);
-
-	ret = func->hif_clear_int_ext(wilc, ENABLE_TX_VMM);
-	if (!ret) {
-		PRINT_ER(vif->ndev, "fail start tx VMM ...\n");
-		goto out_release_bus;
-	}
+		sched->fw_count[i] += ac_pkt_num_to_chip[i];
+	wilc_wlan_tx_bql_batch(slot, entries);
 
-	ret = func->hif_block_tx_ext(wilc, 0, txb, offset);
-	if (!ret)
-		PRINT_ER(vif->ndev, "fail block tx ext...\n");
+	slot->len = slot->end[entries - 1];
+	slot->nseg = use_sg ? slot->seg_end[entries - 1] : 0;
+	slot->npending = entries;
+	/* without scatter-gather the payloads are already copied out */
+	if (!use_sg)
+		wilc_wlan_tx_slot_complete(wilc, slot, 1);
+	wilc->tx_stats.batches++;
+	wilc->tx_stats.frames += entries;
 
-out_release_bus:
-	release_bus(wilc, WILC_BUS_RELEASE_ALLOW_SLEEP, DEV_WIFI);
-	schedule();
+	queue_work(wilc->tx_workqueue, &slot->work);
+	wilc->tx_slot_idx = !wilc->tx_slot_idx;
 
 out:
 	mutex_unlock(&wilc->txq_add_to_head_cs);
 
-	*txq_count = wilc->txq_entries;
+	*txq_count = atomic_read(&wilc->txq_entries);
 	if (ret == 1)
 		cfg_packet_timeout = 0;
 	return ret;
 }
 
-static void wilc_wlan_handle_rx_buff(struct wilc *wilc, u8 *buffer, int size)
+static void wilc_wlan_handle_rx_buff(struct wilc *wilc, struct page *page,
+				     u8 *buffer, int size)
 {
 	int offset = 0;
 	u32 header;
@@ -1306,21 +1779,17 @@ static void wilc_wlan_handle_rx_buff(struct wilc *wilc, u8 *buffer, int size)
 			buff_ptr += HOST_HDR_OFFSET;
 			wilc_wfi_handle_monitor_rx(wilc, buff_ptr, pkt_len);
 		} else if (pkt_len > 0) {
-			struct net_device *wilc_netdev;
 			struct wilc_vif *vif;
 			int srcu_idx;
 
 			srcu_idx = srcu_read_lock(&wilc->srcu);
-			wilc_netdev = get_if_handler(wilc, buff_ptr);
-			if (!wilc_netdev) {
-				pr_err("%s: wilc_netdev in wilc is NULL\n",
-				       __func__);
-				srcu_read_unlock(&wilc->srcu, srcu_idx);
-				return;
-			}
-			vif = netdev_priv(wilc_netdev);
-			wilc_frmw_to_host(vif, buff_ptr, pkt_len,
-					  pkt_offset, PKT_STATUS_NEW);
+			vif = wilc_get_rx_vif(wilc, buff_ptr);
+			if (vif && page)
+				wilc_frmw_to_host_page(vif, page, buff_ptr,
+						       pkt_len, pkt_offset);
+			else if (vif)
+				wilc_frmw_to_host(vif, buff_ptr, pkt_len,
+						  pkt_offset, PKT_STATUS_NEW);
 			srcu_read_unlock(&wilc->srcu, srcu_idx);
 		}
 
@@ -1332,28 +1801,87 @@ static void wilc_wlan_handle_rx_buff(struct wilc *wilc, u8 *buffer, int size)
 
 static void wilc_wlan_handle_rxq(struct wilc *wilc)
 {
-	int size;
-	u8 *buffer;
-	struct rxq_entry_t *rqe;
+	struct wilc_rx_ring *ring = &wilc->rx_ring;
+	struct wilc_rx_desc *desc;
+	struct page *page;
+	u32 tail = ring->tail;
 
-	do {
+	while (tail != smp_load_acquire(&ring->head)) {
 		if (wilc->quit) {
 			pr_info("%s Quitting. Exit handle RX queue\n",
 				__func__);
 			complete(&wilc->cfg_event);
 			break;
 		}
-		rqe = rxq_remove(wilc);
-		if (!rqe)
-			break;
+		desc = &ring->desc[tail % WILC_RX_RING_SIZE];
+		/* payloads in rx_buffer are copied, it is reused right away */
+		page = desc->buffer == wilc->rx_buffer ? NULL : desc->page;
+		wilc_wlan_handle_rx_buff(wilc, page, desc->buffer, desc->size);
+		/* hand the descriptor back to the producer */
+		smp_store_release(&ring->tail, ++tail);
+	}
+	wilc_rx_napi_schedule(wilc);
+}
+
+/*
+ * Buffer for the next RX burst in @desc. Its page is reused once the stack
+ * dropped every fragment taken from it, otherwise a new one is allocated.
+ * Returns NULL if no page is available.
+ */
+static u8 *wilc_wlan_rx_desc_buffer(struct wilc_rx_desc *desc, u32 size,
+				    gfp_t gfp)
+{
+	unsigned int order = max_t(unsigned int, get_order(size),
+				   WILC_RX_PAGE_ORDER_MIN);
+	struct page *page = desc->page;
 
-		buffer = rqe->buffer;
-		size = rqe->buffer_size;
+	if (page && page_count(page) == 1 && desc->order >= order)
+		return page_address(page);
 
-		wilc_wlan_handle_rx_buff(wilc, buffer, size);
+	if (page)
+		put_page(page);
+	desc->page = NULL;
 
-		kfree(rqe);
-	} while (1);
+	page = alloc_pages(gfp | __GFP_COMP | __GFP_NOWARN, order);
+	if (!page)
+		return NULL;
+
+	desc->page = page;
+	desc->order = order;
+	return page_address(page);
+}
+
+static void wilc_wlan_rx_ring_free(struct wilc *wilc)
+{
+	struct wilc_rx_ring *ring = &wilc->rx_ring;
+	int i;
+
+	/* fragments still held by the stack keep their own reference */
+	for (i = 0; i < WILC_RX_RING_SIZE; i++) {
+		if (ring->desc[i].page)
+			put_page(ring->desc[i].page);
+		ring->desc[i].page = NULL;
+	}
+	ring->head = 0;
+	ring->tail = 0;
+}
+
+static int wilc_wlan_rx_ring_alloc(struct wilc *wilc)
+{
+	struct wilc_rx_ring *ring = &wilc->rx_ring;
+	int i;
+
+	ring->head = 0;
+	ring->tail = 0;
+	for (i = 0; i < WILC_RX_RING_SIZE; i++) {
+		if (!wilc_wlan_rx_desc_buffer(&ring->desc[i], PAGE_SIZE,
+					      GFP_KERNEL)) {
+			wilc_wlan_rx_ring_free(wilc);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
 }
 
 static void wilc_unknown_isr_ext(struct wilc *wilc)
@@ -1363,12 +1891,12 @@ static void wilc_unknown_isr_ext(struct wilc *wilc)
 
 static void wilc_wlan_handle_isr_ext(struct wilc *wilc, u32 int_status)
 {
-	u32 offset = wilc->rx_buffer_offset;
+	struct wilc_rx_ring *ring = &wilc->rx_ring;
+	struct wilc_rx_desc *desc;
 	u8 *buffer = NULL;
 	u32 size;
 	u32 retries = 0;
 	int ret = 0;
-	struct rxq_entry_t *rqe;
 
 	size = (int_status & 0x7fff) << 2;
 
@@ -1383,34 +1911,56 @@ static void wilc_wlan_handle_isr_ext(struct wilc *wilc, u32 int_status)
 	if (size <= 0)
 		return;
 
-	if (WILC_RX_BUFF_SIZE - offset < size)
-		offset = 0;
-
-	buffer = &wilc->rx_buffer[offset];
-
-	wilc->hif_func->hif_clear_int_ext(wilc, DATA_INT_CLR | ENABLE_RX_VMM);
+	/*
+	 * Backpressure: no free descriptor until the consumer catches up.
+	 * The ring is drained after every interrupt, so this is only hit
+	 * when processing is behind, and then it runs under the bus.
+	 */
+	if (ring->head - smp_load_acquire(&ring->tail) >= WILC_RX_RING_SIZE) {
+		wilc_wlan_handle_rxq(wilc);
+		if (ring->head - ring->tail >= WILC_RX_RING_SIZE)
+			return;
+	}
+
+	desc = &ring->desc[ring->head % WILC_RX_RING_SIZE];
+	buffer = wilc_wlan_rx_desc_buffer(desc, size, GFP_KERNEL);
+	if (!buffer) {
+		if (size > WILC_RX_BUFF_SIZE) {
+			pr_err("%s: no buffer for %u bytes\n", __func__, size);
+			return;
+		}
+		/* rx_buffer holds a single burst, so empty the ring first */
+		wilc_wlan_handle_rxq(wilc);
+		buffer = wilc->rx_buffer;
+	}
 
-	ret = wilc->hif_func->hif_block_rx_ext(wilc, 0, buffer, size);
+	if (wilc->hif_func->hif_rx_fetch) {
+		ret = wilc->hif_func->hif_rx_fetch(wilc,
+						   DATA_INT_CLR | ENABLE_RX_VMM,
+						   buffer, size);
+	} else {
+		wilc->hif_func->hif_clear_int_ext(wilc,
+						  DATA_INT_CLR | ENABLE_RX_VMM);
+		ret = wilc->hif_func->hif_block_rx_ext(wilc, 0, buffer, size);
+	}
 	if (!ret) {
 		pr_err("%s: fail block rx\n", __func__);
 		return;
 	}
 
-	offset += size;
-	wilc->rx_buffer_offset = offset;
-	rqe = kmalloc(sizeof(*rqe), GFP_KERNEL);
-	if (!rqe)
-		return;
-
-	rqe->buffer = buffer;
-	rqe->buffer_size = size;
-	rxq_add(wilc, rqe);
-	wilc_wlan_handle_rxq(wilc);
+	desc->buffer = buffer;
+	desc->size = size;
+	/* publish the burst, it is processed once the bus is released */
+	smp_store_release(&ring->head, ring->head + 1);
 }
 
-void wilc_handle_isr(struct wilc *wilc)
+/*
+ * Service the chip interrupt status. When polling, an empty status is the
+ * normal idle case and is not cleared. Returns true if data was pending.
+ */
+static bool wilc_wlan_service_int(struct wilc *wilc, bool poll)
 {
-	u32 int_status;
+	u32 int_status = 0;
 
 	acquire_bus(wilc, WILC_BUS_ACQUIRE_AND_WAKEUP, DEV_WIFI);
 	wilc->hif_func->hif_read_int(wilc, &int_status);
@@ -1418,13 +1968,28 @@ void wilc_handle_isr(struct wilc *wilc)
 	if (int_status & DATA_INT_EXT)
 		wilc_wlan_handle_isr_ext(wilc, int_status);
 
-	if (!(int_status & (ALL_INT_EXT))) {
+	if (!poll && !(int_status & (ALL_INT_EXT))) {
 		pr_warn("%s,>> UNKNOWN_INTERRUPT - 0x%08x\n", __func__,
 			  int_status);
 		wilc_unknown_isr_ext(wilc);
 	}
 
 	release_bus(wilc, WILC_BUS_RELEASE_ALLOW_SLEEP, DEV_WIFI);
+
+	/* cfg responses, frame delivery and callbacks run without the bus */
+	wilc_wlan_handle_rxq(wilc);
+
+	return !!(int_status & DATA_INT_EXT);
+}
+
+void wilc_handle_isr(struct wilc *wilc)
+{
+	wilc_wlan_service_int(wilc, false);
+}
+
+bool wilc_poll_isr(struct wilc *wilc)
+{
+	return wilc_wlan_service_int(wilc, true);
 }
 
 int wilc_wlan_firmware_download(struct wilc *wilc, const u8 *buffer,
@@ -1438,6 +2003,7 @@ int wilc_wlan_firmware_download(struct wilc *wilc, const u8 *buffer,
 
 	blksz = BIT(12);
 
+	wilc_reg_cache_invalidate(wilc);
 	dma_buffer = kmalloc(blksz, GFP_KERNEL);
 	if (!dma_buffer)
 		return -EIO;
@@ -1495,6 +2061,7 @@ fail:
 
 int wilc_wlan_start(struct wilc *wilc)
 {
+	struct wilc_reg_op ops[3];
 	u32 reg = 0;
 	int ret;
 
@@ -1503,41 +2070,42 @@ int wilc_wlan_start(struct wilc *wilc)
 		reg |= BIT(3);
 	else if (wilc->io_type == WILC_HIF_SPI)
 		reg = 1;
+	ops[0] = (struct wilc_reg_op){ WILC_REG_WRITE, WILC_VMM_CORE_CFG, reg };
 
-	acquire_bus(wilc, WILC_BUS_ACQUIRE_AND_WAKEUP, DEV_WIFI);
-	ret = wilc->hif_func->hif_write_reg(wilc, WILC_VMM_CORE_CFG, reg);
-	if (!ret) {
-		pr_err("[wilc start]: fail write reg vmm_core_cfg...\n");
-		release_bus(wilc, WILC_BUS_RELEASE_ALLOW_SLEEP, DEV_WIFI);
-		return -EIO;
-	}
 	reg = 0;
 	if (wilc->io_type == WILC_HIF_SDIO_GPIO_IRQ)
 		reg |= WILC_HAVE_SDIO_IRQ_GPIO;
 
 	if (wilc->chip == WILC_3000)
 		reg |= WILC_HAVE_SLEEP_CLK_SRC_RTC;
+	ops[1] = (struct wilc_reg_op){ WILC_REG_WRITE, WILC_GP_REG_1, reg };
+	ops[2] = (struct wilc_reg_op){ WILC_REG_READ, WILC_GLB_RESET_0 };
 
-	ret = wilc->hif_func->hif_write_reg(wilc, WILC_GP_REG_1, reg);
+	acquire_bus(wilc, WILC_BUS_ACQUIRE_AND_WAKEUP, DEV_WIFI);
+	/* the firmware starts from scratch */
+	wilc_reg_cache_invalidate(wilc);
+	ret = wilc_reg_batch(wilc, ops, 3);
 	if (!ret) {
-		pr_err("[wilc start]: fail write WILC_GP_REG_1...\n");
+		pr_err("[wilc start]: fail write vmm_core_cfg/WILC_GP_REG_1...\n");
 		release_bus(wilc, WILC_BUS_RELEASE_ALLOW_SLEEP, DEV_WIFI);
 		return -EIO;
 	}
 
 	wilc->hif_func->hif_sync_ext(wilc, NUM_INT_EXT);
 
-
-	wilc->hif_func->hif_read_reg(wilc, WILC_GLB_RESET_0, &reg);
+	reg = ops[2].val;
+	ops[1] = (struct wilc_reg_op){ WILC_REG_READ, WILC_GLB_RESET_0 };
 	if ((reg & BIT(10)) == BIT(10)) {
 		reg &= ~BIT(10);
-		wilc->hif_func->hif_write_reg(wilc, WILC_GLB_RESET_0, reg);
-		wilc->hif_func->hif_read_reg(wilc, WILC_GLB_RESET_0, &reg);
+		ops[0] = (struct wilc_reg_op){ WILC_REG_WRITE, WILC_GLB_RESET_0,
+					       reg };
+		wilc_reg_batch(wilc, ops, 2);
+		reg = ops[1].val;
 	}
 
 	reg |= BIT(10);
-	ret = wilc->hif_func->hif_write_reg(wilc, WILC_GLB_RESET_0, reg);
-	wilc->hif_func->hif_read_reg(wilc, WILC_GLB_RESET_0, &reg);
+	ops[0] = (struct wilc_reg_op){ WILC_REG_WRITE, WILC_GLB_RESET_0, reg };
+	ret = wilc_reg_batch(wilc, ops, 2);
 
 	if (ret >= 0)
 		wilc->initialized = 1;
@@ -1550,69 +2118,38 @@ int wilc_wlan_start(struct wilc *wilc)
 
 int wilc_wlan_stop(struct wilc *wilc, struct wilc_vif *vif)
 {
-	u32 reg = 0;
+	struct wilc_reg_op ops[4] = {
+		{ WILC_REG_READ, GLOBAL_MODE_CONTROL },
+		{ WILC_REG_READ, PWR_SEQ_MISC_CTRL },
+		{ WILC_REG_READ, WILC_GP_REG_0 },
+	};
 	int ret;
 
 	acquire_bus(wilc, WILC_BUS_ACQUIRE_AND_WAKEUP, DEV_WIFI);
 
-	/* Clear Wifi mode*/
-	ret = wilc->hif_func->hif_read_reg(wilc, GLOBAL_MODE_CONTROL, &reg);
+	ret = wilc_reg_batch(wilc, ops, 3);
 	if (!ret) {
 		PRINT_ER(vif->ndev, "Error while reading reg\n");
 		release_bus(wilc, WILC_BUS_RELEASE_ALLOW_SLEEP, DEV_WIFI);
 		return -EIO;
 	}
 
-	reg &= ~BIT(0);
-	ret = wilc->hif_func->hif_write_reg(wilc, GLOBAL_MODE_CONTROL, reg);
-	if (!ret) {
-		PRINT_ER(vif->ndev, "Error while writing reg\n");
-		release_bus(wilc, WILC_BUS_RELEASE_ALLOW_SLEEP, DEV_WIFI);
-		return -EIO;
-	}
+	/* Clear Wifi mode*/
+	ops[0].val &= ~BIT(0);
 
 	/* Configure the power sequencer to ignore WIFI sleep signal on making
 	 * chip sleep decision
 	 */
-	ret = wilc->hif_func->hif_read_reg(wilc, PWR_SEQ_MISC_CTRL, &reg);
-	if (!ret) {
-		PRINT_ER(vif->ndev, "Error while reading reg\n");
-		release_bus(wilc, WILC_BUS_RELEASE_ALLOW_SLEEP, DEV_WIFI);
-		return -EIO;
-	}
-
-	reg &= ~BIT(28);
-	ret = wilc->hif_func->hif_write_reg(wilc, PWR_SEQ_MISC_CTRL, reg);
-	if (!ret) {
-		PRINT_ER(vif->ndev, "Error while writing reg\n");
-		release_bus(wilc, WILC_BUS_RELEASE_ALLOW_SLEEP, DEV_WIFI);
-		return -EIO;
-	}
-
-	ret = wilc->hif_func->hif_read_reg(wilc, WILC_GP_REG_0, &reg);
-	if (!ret) {
-		PRINT_ER(vif->ndev, "Error while reading reg\n");
-		release_bus(wilc, WILC_BUS_RELEASE_ALLOW_SLEEP, DEV_WIFI);
-		return -EIO;
-	}
+	ops[1].val &= ~BIT(28);
 
-	ret = wilc->hif_func->hif_write_reg(wilc, WILC_GP_REG_0,
-					(reg | WILC_ABORT_REQ_BIT));
-	if (!ret) {
-		PRINT_ER(vif->ndev, "Error while writing reg\n");
-		release_bus(wilc, WILC_BUS_RELEASE_ALLOW_SLEEP, DEV_WIFI);
-		return -EIO;
-	}
-
-	ret = wilc->hif_func->hif_read_reg(wilc, WILC_FW_HOST_COMM, &reg);
-	if (!ret) {
-		PRINT_ER(vif->ndev, "Error while reading reg\n");
-		release_bus(wilc, WILC_BUS_RELEASE_ALLOW_SLEEP, DEV_WIFI);
-		return -EIO;
-	}
-	reg = BIT(0);
+	ops[2].val |= WILC_ABORT_REQ_BIT;
+	ops[3] = (struct wilc_reg_op){ WILC_REG_WRITE, WILC_FW_HOST_COMM,
+				       BIT(0) };
+	ops[0].type = WILC_REG_WRITE;
+	ops[1].type = WILC_REG_WRITE;
+	ops[2].type = WILC_REG_WRITE;
 
-	ret = wilc->hif_func->hif_write_reg(wilc, WILC_FW_HOST_COMM, reg);
+	ret = wilc_reg_batch(wilc, ops, 4);
 	if (!ret) {
 		PRINT_ER(vif->ndev, "Error while writing reg\n");
 		release_bus(wilc, WILC_BUS_RELEASE_ALLOW_SLEEP, DEV_WIFI);
@@ -1624,37 +2161,43 @@ int wilc_wlan_stop(struct wilc *wilc, struct wilc_vif *vif)
 	return 0;
 }
 
+static void wilc_wlan_free_tx_slots(struct wilc *wilc)
+{
+	int i;
+
+	for (i = 0; i < WILC_TX_SLOTS; i++) {
+		kfree(wilc->tx_slot[i].buffer);
+		wilc->tx_slot[i].buffer = NULL;
+		kfree(wilc->tx_slot[i].sg.hdr_buf);
+		wilc->tx_slot[i].sg.hdr_buf = NULL;
+	}
+}
+
 void wilc_wlan_cleanup(struct net_device *dev)
 {
 	struct txq_entry_t *tqe;
-	struct rxq_entry_t *rqe;
 	u8 ac;
 	struct wilc_vif *vif = netdev_priv(dev);
 	struct wilc *wilc = vif->wilc;
 
 	wilc->quit = 1;
+	wilc_wlan_tx_flush(wilc);
 	for (ac = 0; ac < NQUEUES; ac++) {
 		do {
-			tqe = wilc_wlan_txq_remove_from_head(wilc, ac);
+			tqe = wilc_wlan_txq_remove_from_head(wilc, ac,
+					&wilc->tx_slot[0].batch.net_tqe[0]);
 			if (!tqe)
 				break;
-			if (tqe->tx_complete_func)
-				tqe->tx_complete_func(tqe->priv, 0);
-			kfree(tqe);
+			if (tqe->type == WILC_NET_PKT)
+				wilc_wlan_bql_completed(tqe->priv);
+			wilc_wlan_tx_complete(wilc, tqe, 0);
 		} while (1);
 	}
 
-	do {
-		rqe = rxq_remove(wilc);
-		if (!rqe)
-			break;
-		kfree(rqe);
-	} while (1);
-
+	wilc_wlan_rx_ring_free(wilc);
 	kfree(wilc->rx_buffer);
 	wilc->rx_buffer = NULL;
-	kfree(wilc->tx_buffer);
-	wilc->tx_buffer = NULL;
+	wilc_wlan_free_tx_slots(wilc);
 }
 
 static int wilc_wlan_cfg_commit(struct wilc_vif *vif, int type,
@@ -1858,6 +2401,122 @@ end:
 	return ret;
 }
 
+/*
+ * Registers only the host writes: the wakeup and host-to-firmware
+ * handshake bits. On WILC3000 SDIO 0xf0 also carries the clock status.
+ */
+static bool wilc_reg_cacheable(struct wilc *wilc, u32 addr)
+{
+	if (wilc->io_type == WILC_HIF_SPI)
+		return addr == 0x1 || addr == 0x0b;
+
+	return addr == 0xfa || (addr == 0xf0 && wilc->chip == WILC_1000);
+}
+
+static int wilc_reg_cache_find(struct wilc_reg_cache *c, u32 addr)
+{
+	int i;
+
+	for (i = 0; i < c->num; i++)
+		if (c->addr[i] == addr)
+			return i;
+
+	return -1;
+}
+
+static void wilc_reg_cache_store(struct wilc *wilc, u32 addr, u32 val)
+{
+	struct wilc_reg_cache *c = &wilc->reg_cache;
+	int i;
+
+	if (!wilc_reg_cacheable(wilc, addr))
+		return;
+
+	i = wilc_reg_cache_find(c, addr);
+	if (i < 0) {
+		if (c->num == WILC_REG_CACHE_SIZE)
+			return;
+		i = c->num++;
+		c->addr[i] = addr;
+	}
+	c->val[i] = val;
+}
+
+/* called whenever the chip may have lost or changed the cached values */
+void wilc_reg_cache_invalidate(struct wilc *wilc)
+{
+	wilc->reg_cache.num = 0;
+}
+
+/* Must be called with the bus acquired, like the hif accessors */
+int wilc_reg_read_cached(struct wilc *wilc, u32 addr, u32 *val)
+{
+	struct wilc_reg_cache *c = &wilc->reg_cache;
+	int i = wilc_reg_cache_find(c, addr);
+	int ret;
+
+	if (i >= 0) {
+		c->hits++;
+		*val = c->val[i];
+		return 1;
+	}
+
+	if (wilc_reg_cacheable(wilc, addr))
+		c->misses++;
+	ret = wilc->hif_func->hif_read_reg(wilc, addr, val);
+	if (ret)
+		wilc_reg_cache_store(wilc, addr, *val);
+
+	return ret;
+}
+
+int wilc_reg_write_cached(struct wilc *wilc, u32 addr, u32 val)
+{
+	int ret;
+
+	ret = wilc->hif_func->hif_write_reg(wilc, addr, val);
+	if (ret)
+		wilc_reg_cache_store(wilc, addr, val);
+	else
+		wilc_reg_cache_invalidate(wilc);
+
+	return ret;
+}
+
+/*
+ * Run a register access sequence, as one bus transaction when the bus
+ * supports it. No write in it may depend on a read of the same batch.
+ * On failure it is unknown which of the writes reached the chip.
+ */
+int wilc_reg_batch(struct wilc *wilc, struct wilc_reg_op *ops, int n)
+{
+	const struct wilc_hif_func *func = wilc->hif_func;
+	int i, ret = 1;
+
+	if (func->hif_reg_batch) {
+		ret = func->hif_reg_batch(wilc, ops, n);
+	} else {
+		for (i = 0; i < n && ret; i++) {
+			if (ops[i].type == WILC_REG_READ)
+				ret = func->hif_read_reg(wilc, ops[i].addr,
+							 &ops[i].val);
+			else
+				ret = func->hif_write_reg(wilc, ops[i].addr,
+							  ops[i].val);
+		}
+	}
+
+	/* keep the register cache in step with what went over the bus */
+	if (!ret) {
+		wilc_reg_cache_invalidate(wilc);
+		return ret;
+	}
+	for (i = 0; i < n; i++)
+		wilc_reg_cache_store(wilc, ops[i].addr, ops[i].val);
+
+	return ret;
+}
+
 u32 wilc_get_chipid(struct wilc *wilc, bool update)
 {
 	static u32 chipid;
@@ -1891,6 +2550,7 @@ u32 wilc_get_chipid(struct wilc *wilc, bool update)
 int wilc_wlan_init(struct net_device *dev)
 {
 	int ret = 0;
+	int i;
 	struct wilc_vif *vif = netdev_priv(dev);
 	struct wilc *wilc;
 
@@ -1902,6 +2562,7 @@ int wilc_wlan_init(struct net_device *dev)
 
 	if (!wilc->hif_func->hif_is_init(wilc)) {
 		acquire_bus(wilc, WILC_BUS_ACQUIRE_ONLY, DEV_WIFI);
+		wilc_reg_cache_invalidate(wilc);
 		if (!wilc->hif_func->hif_init(wilc, false)) {
 			ret = -EIO;
 			release_bus(wilc, WILC_BUS_RELEASE_ONLY, DEV_WIFI);
@@ -1910,13 +2571,29 @@ int wilc_wlan_init(struct net_device *dev)
 		release_bus(wilc, WILC_BUS_RELEASE_ONLY, DEV_WIFI);
 	}
 
-	if (!wilc->tx_buffer)
-		wilc->tx_buffer = kmalloc(WILC_TX_BUFF_SIZE, GFP_KERNEL);
+	for (i = 0; i < WILC_TX_SLOTS; i++) {
+		struct wilc_tx_slot *slot = &wilc->tx_slot[i];
 
-	if (!wilc->tx_buffer) {
-		ret = -ENOBUFS;
-		PRINT_ER(vif->ndev, "Can't allocate Tx Buffer");
-		goto fail;
+		/* scatter-gather only needs room for the per-packet headers */
+		if (wilc->hif_func->hif_block_tx_ext_sg) {
+			if (!slot->sg.hdr_buf)
+				slot->sg.hdr_buf = kzalloc(WILC_TX_SG_HDR_SIZE,
+							   GFP_KERNEL);
+			if (!slot->sg.hdr_buf) {
+				ret = -ENOBUFS;
+				PRINT_ER(vif->ndev, "Can't allocate Tx Buffer");
+				goto fail;
+			}
+		} else {
+			if (!slot->buffer)
+				slot->buffer = kmalloc(WILC_TX_BUFF_SIZE,
+						       GFP_KERNEL);
+			if (!slot->buffer) {
+				ret = -ENOBUFS;
+				PRINT_ER(vif->ndev, "Can't allocate Tx Buffer");
+				goto fail;
+			}
+		}
 	}
 
 	if (!wilc->rx_buffer)
@@ -1928,6 +2605,12 @@ int wilc_wlan_init(struct net_device *dev)
 		goto fail;
 	}
 
+	if (wilc_wlan_rx_ring_alloc(wilc)) {
+		ret = -ENOBUFS;
+		PRINT_ER(vif->ndev, "Can't allocate Rx ring");
+		goto fail;
+	}
+
 	if (!init_chip(dev)) {
 		ret = -EIO;
 		goto fail;
@@ -1937,10 +2620,10 @@ int wilc_wlan_init(struct net_device *dev)
 
 fail:
 
+	wilc_wlan_rx_ring_free(wilc);
 	kfree(wilc->rx_buffer);
 	wilc->rx_buffer = NULL;
-	kfree(wilc->tx_buffer);
-	wilc->tx_buffer = NULL;
+	wilc_wlan_free_tx_slots(wilc);
 
 	return ret;
 }
@@ -9,6 +9,7 @@
 
 #include <linux/types.h>
 #include <linux/version.h>
+#include <linux/llist.h>
 
 static inline bool is_wilc1000(u32 id)
 {
@@ -145,8 +146,20 @@ static inline bool is_wilc3000(u32 id)
 #define WILC_ABORT_REQ_BIT		BIT(31)
 
 #define WILC_RX_BUFF_SIZE	(96 * 1024)
+/* RX bursts are read into pages of at least this order */
+#define WILC_RX_PAGE_ORDER_MIN	3
+/* frames up to this size are copied whole, larger ones are fragmented */
+#define WILC_RX_COPYBREAK	256
+/* bytes copied to the linear area of a fragmented frame, covers headers */
+#define WILC_RX_HDR_LEN		128
 #define WILC_TX_BUFF_SIZE	(64 * 1024)
 
+/* scatter-gather TX: header, payload and tail padding per VMM entry */
+#define WILC_TX_SG_MAX_SEGS	(3 * WILC_VMM_TBL_SIZE)
+#define WILC_TX_SG_HDR_SLOT	ETH_CONFIG_PKT_HDR_OFFSET
+#define WILC_TX_SG_PAD_OFFSET	(WILC_VMM_TBL_SIZE * WILC_TX_SG_HDR_SLOT)
+#define WILC_TX_SG_HDR_SIZE	(WILC_TX_SG_PAD_OFFSET + 4)
+
 #define MODALIAS		"WILC_SPI"
 #define GPIO_NUM		0x5B
 #define GPIO_NUM_CHIP_EN	94
@@ -161,7 +174,9 @@ static inline bool is_wilc3000(u32 id)
 #define BE_AC_ACM_STAT_POS	8
 #define BK_AC_COUNT_POS		2
 #define BK_AC_ACM_STAT_POS	1
-#define AC_BUFFER_SIZE		1000
+/* DRR quanta are in bytes of VMM space, one unit fits a full size frame */
+#define WILC_TX_QUANTUM_UNIT	1536
+#define WILC_TX_QUANTUM_MIN	256
 /*******************************************/
 /*        E0 and later Interrupt flags.    */
 /*******************************************/
@@ -241,7 +256,6 @@ struct txq_entry_t {
 	struct list_head list;
 	int type;
 	u8 q_num;
-	int ack_idx;
 	u8 *buffer;
 	int buffer_size;
 	void *priv;
@@ -250,16 +264,77 @@ struct txq_entry_t {
 	void (*tx_complete_func)(void *priv, int status);
 };
 
+/*
+ * Per-packet state of a queued net frame, kept in skb->cb so the data path
+ * does not allocate anything per packet.
+ */
+struct wilc_skb_tx_cb {
+	struct llist_node node;
+	struct wilc_vif *vif;
+	/* set while this is the newest queued pure ACK of its flow */
+	struct wilc_ack_flow *ack_flow;
+	/* ktime_get() in ns when the frame was queued, for CoDel */
+	u64 enqueue_ns;
+	u8 q_num;
+	bool ack_superseded;
+	/* put back after a dequeue, CoDel already saw it */
+	bool requeued;
+};
+
+#define WILC_CODEL_TARGET_NS	(5 * NSEC_PER_MSEC)
+#define WILC_CODEL_INTERVAL_NS	(100 * NSEC_PER_MSEC)
+
+/* CoDel state of one AC queue, only touched by the TX thread */
+struct wilc_codel {
+	u64 first_above_ns;
+	u64 drop_next_ns;
+	u32 count;
+	/* count when the last dropping state was entered */
+	u32 lastcount;
+	bool dropping;
+	/* statistics, exported through debugfs */
+	u32 packets;
+	u32 drops;
+	u32 marks;
+	u64 sojourn_sum_ns;
+	u64 sojourn_max_ns;
+};
+
+#define WILC_SKB_TX_CB(skb)	((struct wilc_skb_tx_cb *)(skb)->cb)
+
 struct txq_handle {
+	/* cfg and mgmt frames, sent before any queued net frame */
 	struct txq_entry_t txq_head;
-	u16 count;
+	/* net frames pushed lock free by senders, newest first */
+	struct llist_head stage;
+	/* net frames in order, only touched by the TX thread */
+	struct sk_buff_head skb_head;
+	atomic_t count;
+	struct wilc_codel codel;
 	u8 acm;
 };
 
-struct rxq_entry_t {
-	struct list_head list;
+#define WILC_RX_RING_SIZE	8
+
+/* one RX burst read from the chip */
+struct wilc_rx_desc {
+	/* owned page, reused once the stack released its fragments */
+	struct page *page;
+	unsigned int order;
+	/* in page, or in rx_buffer if no page could be allocated */
 	u8 *buffer;
-	int buffer_size;
+	u32 size;
+};
+
+/*
+ * Bursts go from the bus read (producer) to RX processing (consumer).
+ * head and tail run freely and index the descriptors modulo the size;
+ * the producer owns desc[head], the consumer desc[tail] until head.
+ */
+struct wilc_rx_ring {
+	struct wilc_rx_desc desc[WILC_RX_RING_SIZE];
+	u32 head;
+	u32 tail;
 };
 
 enum wilc_chip_type {
@@ -267,6 +342,130 @@ enum wilc_chip_type {
 	WILC_3000,
 };
 
+struct wilc_tx_seg {
+	u8 *buf;
+	u32 len;
+};
+
+struct wilc_tx_sg {
+	u8 *hdr_buf;
+	struct wilc_tx_seg seg[WILC_TX_SG_MAX_SEGS];
+};
+
+/*
+ * Frames dequeued for one VMM transfer. Net frames are described by the
+ * entries in net_tqe, filled from the skb when it is dequeued.
+ */
+struct wilc_tx_batch {
+	struct txq_entry_t *tqe[WILC_VMM_TBL_SIZE];
+	struct txq_entry_t net_tqe[WILC_VMM_TBL_SIZE];
+	u8 ac[WILC_VMM_TBL_SIZE];
+};
+
+/* deficit round robin state of the four AC queues */
+struct wilc_tx_sched {
+	u32 quantum[NQUEUES];
+	int deficit[NQUEUES];
+	/* frames per AC in the firmware, as read from WILC_HOST_TX_CTRL */
+	u8 fw_count[NQUEUES];
+	u16 reserve[NQUEUES];
+};
+
+#define WILC_TX_SLOTS		2
+
+/*
+ * One packed TX batch. While the bus sends one slot, the TX thread packs
+ * the next batch into the other one.
+ */
+struct wilc_tx_slot {
+	struct wilc *wilc;
+	struct work_struct work;
+	u8 *buffer;
+	struct wilc_tx_sg sg;
+	struct wilc_tx_batch batch;
+	/* bytes and segments packed up to and including each entry */
+	u32 end[WILC_VMM_TBL_SIZE];
+	u16 seg_end[WILC_VMM_TBL_SIZE];
+	u32 len;
+	u32 nseg;
+	int npending;
+	/*
+	 * With an async bus the work runs twice: once to queue the data and
+	 * once, from the bus completion, to finish the slot.
+	 */
+	bool finishing;
+	int status;
+	ktime_t start;
+	/* no data phase pending, the slot can be packed again */
+	struct completion done;
+};
+
+struct wilc_tx_stats {
+	u64 bus_busy_ns;
+	/* time the bus sat idle between TX transfers with frames queued */
+	u64 bus_idle_ns;
+	u32 batches;
+	u32 frames;
+};
+
+enum wilc_bus_err_type {
+	/* the controller failed the transfer */
+	WILC_BUS_ERR_XFER,
+	/* nothing answered, the data line stayed idle */
+	WILC_BUS_ERR_NO_RSP,
+	/* unexpected response or state from the chip */
+	WILC_BUS_ERR_PROTO,
+	/* data CRC16 mismatch */
+	WILC_BUS_ERR_CRC,
+	WILC_BUS_ERR_TYPES,
+};
+
+/* errors per bus command, SPI counts by the low nibble of the opcode */
+#define WILC_BUS_ERR_CMDS		16
+
+struct wilc_bus_err_stats {
+	u32 type[WILC_BUS_ERR_TYPES];
+	/* cmd[i] counts the errors of command cmd_base | i */
+	u32 cmd[WILC_BUS_ERR_CMDS];
+	u8 cmd_base;
+	u32 retries;
+	/* commands that went through after one or more retries */
+	u32 recovered;
+	/* commands that ran out of retries */
+	u32 failed;
+	/* bus clock reductions after error bursts */
+	u32 slowdowns;
+	u32 speed_hz;
+};
+
+#define WILC_REG_CACHE_SIZE		4
+
+/*
+ * Last known value of registers only the host writes, so their
+ * read-modify-write sequences skip the read
+ */
+struct wilc_reg_cache {
+	u32 addr[WILC_REG_CACHE_SIZE];
+	u32 val[WILC_REG_CACHE_SIZE];
+	u8 num;
+	u32 hits;
+	u32 misses;
+};
+
+#define WILC_REG_BATCH_MAX		8
+
+enum wilc_reg_op_type {
+	WILC_REG_READ,
+	WILC_REG_WRITE,
+};
+
+/* one access of a register batch, @val holds the result of a read */
+struct wilc_reg_op {
+	u8 type;
+	u32 addr;
+	u32 val;
+};
+
 /********************************************
  *
  *      Host IF Structure
@@ -285,6 +484,26 @@ struct wilc_hif_func {
 	int (*hif_read_size)(struct wilc *wilc, u32 *size);
 	int (*hif_block_tx_ext)(struct wilc *wilc, u32 addr, u8 *buf, u32 size);
 	int (*hif_block_rx_ext)(struct wilc *wilc, u32 addr, u8 *buf, u32 size);
+	/* optional, buses without scatter-gather copy into a slot buffer */
+	int (*hif_block_tx_ext_sg)(struct wilc *wilc, u32 addr,
+				   struct wilc_tx_seg *seg, u32 nseg,
+				   u32 size);
+	/*
+	 * optional, queues the data phase and returns, @done gets the result
+	 * and may be called in atomic context
+	 */
+	int (*hif_block_tx_ext_async)(struct wilc *wilc, u32 addr,
+				      struct wilc_tx_seg *seg, u32 nseg,
+				      u32 size,
+				      void (*done)(void *priv, int status),
+				      void *priv);
+	/* optional, clear the RX interrupt and read the burst in one go */
+	int (*hif_rx_fetch)(struct wilc *wilc, u32 clear, u8 *buf, u32 size);
+	/*
+	 * optional, runs up to WILC_REG_BATCH_MAX accesses in one bus
+	 * transaction; no write is sent twice, a bad one fails the batch
+	 */
+	int (*hif_reg_batch)(struct wilc *wilc, struct wilc_reg_op *ops, int n);
 	int (*hif_sync_ext)(struct wilc *wilc, int nint);
 	int (*enable_interrupt)(struct wilc *nic);
 	void (*disable_interrupt)(struct wilc *nic);
@@ -294,13 +513,6 @@ struct wilc_hif_func {
 
 #define WILC_MAX_CFG_FRAME_SIZE		1468
 
-struct tx_complete_data {
-	int size;
-	void *buff;
-	struct sk_buff *skb;
-	struct wilc_vif *vif;
-};
-
 struct wilc_cfg_cmd_hdr {
 	u8 cmd_type;
 	u8 seq_no;
@@ -320,16 +532,23 @@ struct wilc_cfg_rsp {
 
 struct wilc;
 struct wilc_vif;
+struct tcp_ack_filter;
 
 int wilc_wlan_firmware_download(struct wilc *wilc, const u8 *buffer,
 				u32 buffer_size);
 int wilc_wlan_start(struct wilc *wilc);
 int wilc_wlan_stop(struct wilc *wilc, struct wilc_vif *vif);
-int txq_add_net_pkt(struct net_device *dev, void *priv, u8 *buffer,
-			      u32 buffer_size,
-			      void (*tx_complete_fn)(void *, int));
+int txq_add_net_pkt(struct net_device *dev, struct sk_buff *skb);
+u16 wilc_wlan_select_queue(struct wilc *wilc, struct sk_buff *skb);
+bool wilc_wlan_txq_stop_needed(struct wilc *wilc, u8 q_num);
+bool wilc_wlan_txq_wake_allowed(struct wilc *wilc, u8 q_num);
 int wilc_wlan_handle_txq(struct wilc *wilc, u32 *txq_count);
+void wilc_wlan_tx_slot_work(struct work_struct *work);
+void wilc_wlan_tx_flush(struct wilc *wilc);
+void wilc_wlan_tx_sched_init(struct wilc *wilc);
+int wilc_wlan_set_tx_quantum(struct wilc *wilc, u8 ac, u32 quantum);
 void wilc_handle_isr(struct wilc *wilc);
+bool wilc_poll_isr(struct wilc *wilc);
 void wilc_wlan_cleanup(struct net_device *dev);
 int cfg_set(struct wilc_vif *vif, int start, u16 wid, u8 *buffer,
 		      u32 buffer_size, int commit, u32 drv_handler);
@@ -340,6 +559,7 @@ int txq_add_mgmt_pkt(struct net_device *dev, void *priv, u8 *buffer,
 			       void (*tx_complete_fn)(void *, int));
 
 void wilc_enable_tcp_ack_filter(struct wilc_vif *vif, bool value);
+void wilc_ack_filter_init(struct tcp_ack_filter *f);
 netdev_tx_t wilc_mac_xmit(struct sk_buff *skb, struct net_device *dev);
 
 bool wilc_wfi_p2p_rx(struct wilc_vif *vif, u8 *buff, u32 size);
@@ -363,5 +583,9 @@ void acquire_bus(struct wilc *wilc, enum bus_acquire acquire, int source);
 void release_bus(struct wilc *wilc, enum bus_release release, int source);
 int wilc_wlan_init(struct net_device *dev);
 u32 wilc_get_chipid(struct wilc *wilc, bool update);
+int wilc_reg_batch(struct wilc *wilc, struct wilc_reg_op *ops, int n);
+int wilc_reg_read_cached(struct wilc *wilc, u32 addr, u32 *val);
+int wilc_reg_write_cached(struct wilc *wilc, u32 addr, u32 val);
+void wilc_reg_cache_invalidate(struct wilc *wilc);
 void wilc_wfi_handle_monitor_rx(struct wilc *wilc, u8 *buff, u32 size);
 #endif